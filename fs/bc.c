@@ -1,4 +1,6 @@
 
+#include <arch/thread.h>
+
 #include "fs.h"
 
 // Return the virtual address of this disk block.
@@ -24,24 +26,174 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
-// Fault any disk block that is read in to memory by
-// loading it from disk.
+// Disk reads that yield to other file server threads while the drive
+// works.  The IDE channel takes one command at a time, so at most one
+// read is in flight; bc_inflight names its block.  The data lands in
+// the BCTEMP staging page and is mapped at the block's address only
+// once complete, so no thread sees a half-read block.  Anyone else who
+// needs the drive first finishes the read in flight without yielding:
+// bc_pgfault runs on the one exception stack and so must never yield.
+static uint32_t bc_inflight;
+
+// Number of threads waiting in bc_fetch for the drive.
+int bc_nwaiting;
+
+static uint32_t nhits, nmisses, nflushes;
+
+// The dirty set.  Cached blocks are mapped read-only until first
+// written; the write faults, and bc_pgfault maps the block writable and
+// adds it here (bc_zero adds the blocks it creates itself).  Writing a
+// block back maps it read-only again and takes it out, so sync touches
+// only the blocks in the set.  dirtysum has a bit for each word of
+// dirty, so bc_sync skips clean stretches 1024 blocks at a time and
+// still finds the dirty blocks in block order.
+static uint32_t dirty[DISKSIZE / BLKSIZE / 32];
+static uint32_t dirtysum[DISKSIZE / BLKSIZE / 32 / 32];
+static uint32_t ndirty;
+
+// Longest run of blocks bc_sync writes with one command
+#define MAXRUN	(256 / BLKSECTS)
+
+static bool
+block_is_dirty(uint32_t blockno)
+{
+	return (dirty[blockno / 32] & (1U << (blockno % 32))) != 0;
+}
+
+// Add block blockno, which is mapped writable, to the dirty set.
+static void
+dirty_add(uint32_t blockno)
+{
+	if (!block_is_dirty(blockno))
+		ndirty++;
+	dirty[blockno / 32] |= 1U << (blockno % 32);
+	dirtysum[blockno / 1024] |= 1U << (blockno / 32 % 32);
+}
+
+// Map the n blocks from blockno, just written back, read-only (which
+// also clears PTE_D) and take them out of the dirty set.
+static void
+dirty_remove(uint32_t blockno, uint32_t n)
+{
+	struct PageMap pm = { PM_MAP, 0, (uintptr_t) diskaddr(blockno),
+			      0, (uintptr_t) diskaddr(blockno), PTE_P|PTE_U, n };
+	int r;
+
+	if ((r = sys_page_map_range(&pm, 1)) < 0)
+		panic("dirty_remove: %e", r);
+	for (; n > 0; n--, blockno++) {
+		ndirty--;
+		dirty[blockno / 32] &= ~(1U << (blockno % 32));
+		if (!dirty[blockno / 32])
+			dirtysum[blockno / 1024] &= ~(1U << (blockno / 32 % 32));
+	}
+}
+
+// The kernel tells us when the drive finishes a command by sending an
+// IPC from envid 0 (see sys_irq_listen), so a server whose threads are
+// all waiting for the disk sleeps in ipc_recv rather than spinning.
+// The drive interrupts for every command, including the ones we wait
+// for synchronously, so serve ignores notifications that find nobody
+// waiting.
+
+// Collect the read in flight, if any, and map it at its block.
 static void
+bc_read_finish(void)
+{
+	uint32_t blockno = bc_inflight;
+	int r;
+
+	if (!blockno)
+		return;
+	if ((r = ide_read_finish(BCTEMP, BLKSECTS)) < 0)
+		panic("bc_read_finish: block %08x: %e", blockno, r);
+	if ((r = sys_page_map(0, BCTEMP, 0, diskaddr(blockno), PTE_P|PTE_U)) < 0)
+		panic("bc_read_finish: %e", r);
+	sys_page_unmap(0, BCTEMP);
+	bc_inflight = 0;
+
+	if (bitmap && block_is_free(blockno))
+		panic("reading free block %08x\n", blockno);
+}
+
+// Make sure the block containing addr is in memory, letting other
+// threads run while the drive reads it.
+void
+bc_fetch(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	int r;
+
+	if (va_is_mapped(addr))
+		nhits++;
+	while (!va_is_mapped(addr)) {
+		if (bc_inflight) {
+			if (ide_busy()) {
+				bc_nwaiting++;
+				while (ide_busy())
+					thread_yield();
+				bc_nwaiting--;
+			}
+			bc_read_finish();
+			continue;
+		}
+		if ((r = sys_page_alloc(0, BCTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("bc_fetch: %e", r);
+		if ((r = ide_read_start(blockno * BLKSECTS, BLKSECTS)) < 0)
+			panic("bc_fetch: block %08x: %e", blockno, r);
+		bc_inflight = blockno;
+		nmisses++;
+		trace(FSTRACE_READ, 0, blockno);
+	}
+}
+
+// Map a zero-filled page for block blockno, which was just allocated,
+// instead of reading its old contents from disk.  The block goes in
+// the dirty set so that the zeros reach the disk.
+void
+bc_zero(uint32_t blockno)
+{
+	char *addr = diskaddr(blockno);
+	int r;
+
+	if (bc_inflight == blockno)
+		bc_read_finish();
+	if ((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_zero: %e", r);
+	dirty_add(blockno);
+	*(volatile char *) addr = 0;
+}
+
+// Fault any disk block that is read in to memory by
+// loading it from disk, and note the first write to a cached block in
+// the dirty set.  Returns 0 for faults outside the block cache.
+static int
 bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
-	int r;
+	int r, perm;
 
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
-		panic("page fault in FS: eip %08x, va %08x, err %04x",
-		      utf->utf_eip, addr, utf->utf_err);
+		return 0;
 
 	// Sanity check the block number.
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
+	// The drive may be busy with another thread's read, which may
+	// even be this block.
+	bc_read_finish();
+	if (va_is_mapped(addr)) {
+		if ((utf->utf_err & FEC_WR) && !block_is_dirty(blockno)) {
+			if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("in bc_pgfault, sys_page_map: %e", r);
+			dirty_add(blockno);
+		}
+		return 1;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
@@ -52,26 +204,47 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("bc_pgfault: %e");
 	}
 	ide_read(blockno * BLKSECTS, (void*)ROUNDDOWN(addr, PGSIZE), BLKSECTS);
+	nmisses++;
+	trace(FSTRACE_READ, 0, blockno);
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+	// Map the block read-only, which also clears the dirty bit, since
+	// we just read the block from disk; or, if this fault is a write,
+	// writable and in the dirty set straight away.
+	perm = PTE_P|PTE_U;
+	if (utf->utf_err & FEC_WR)
+		perm |= PTE_W;
+	if ((r = sys_page_map(0, addr, 0, addr, perm)) < 0)
 		panic("in bc_pgfault, sys_page_map: %e", r);
+	if (perm & PTE_W)
+		dirty_add(blockno);
 
 	// Check that the block we read was allocated. (exercise for
 	// the reader: why do we do this *after* reading the block
 	// in?)
 	if (bitmap && block_is_free(blockno))
 		panic("reading free block %08x\n", blockno);
+	return 1;
+}
+
+// Write the n dirty blocks starting at blockno out to disk with one
+// command, and take them out of the dirty set.
+static void
+write_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t i;
+
+	bc_read_finish();
+	ide_write(blockno * BLKSECTS, diskaddr(blockno), n * BLKSECTS);
+	for (i = 0; i < n; i++) {
+		nflushes++;
+		trace(FSTRACE_WRITE, 0, blockno + i);
+	}
+	dirty_remove(blockno, n);
 }
 
 // Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
+// necessary, then map it read-only again to clear the PTE_D bit.
+// If the block is not in the dirty set, does nothing.
 void
 flush_block(void *addr)
 {
@@ -80,14 +253,71 @@ flush_block(void *addr)
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
 
-	if ( !va_is_mapped(addr) || !va_is_dirty(addr) ) return;
-	ide_write(blockno * BLKSECTS, (void*)ROUNDDOWN(addr, PGSIZE), BLKSECTS);
-	int r;
-	if ( (r = sys_page_map(0, ROUNDDOWN(addr, PGSIZE), 0, ROUNDDOWN(addr, PGSIZE), uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0 ){
-		panic("flush_block: %e", r);
+	if (block_is_dirty(blockno))
+		write_run(blockno, 1);
+}
+
+// Write every dirty block out to disk, in block order, merging runs of
+// consecutive blocks into single writes.
+void
+bc_sync(void)
+{
+	uint32_t s, w, sum, bits, blockno, start = 0, n = 0;
+
+	for (s = 0; s < ARRAY_SIZE(dirtysum); s++) {
+		for (sum = dirtysum[s], w = s * 32; sum; sum >>= 1, w++) {
+			if (!(sum & 1))
+				continue;
+			for (bits = dirty[w], blockno = w * 32; bits;
+			     bits >>= 1, blockno++) {
+				if (!(bits & 1))
+					continue;
+				if (n && (blockno != start + n || n == MAXRUN)) {
+					write_run(start, n);
+					n = 0;
+				}
+				if (n++ == 0)
+					start = blockno;
+			}
+		}
+	}
+	if (n)
+		write_run(start, n);
+}
+
+// Return the number of blocks in the dirty set.
+uint32_t
+bc_ndirty(void)
+{
+	return ndirty;
+}
+
+// Evict every clean block from the cache, so that benchmarks can
+// start cold.  Pages clients mapped with FSREQ_MAP keep their old
+// contents.
+void
+bc_drop_clean(void)
+{
+	uintptr_t va;
+
+	bc_read_finish();
+	for (va = DISKMAP + 2 * BLKSIZE; va < DISKMAP + DISKSIZE; va += BLKSIZE) {
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			va = ROUNDUP(va + 1, PTSIZE) - BLKSIZE;
+			continue;
+		}
+		if (va_is_mapped((void *) va)
+		    && !block_is_dirty((va - DISKMAP) / BLKSIZE))
+			sys_page_unmap(0, (void *) va);
 	}
-	// LAB 5: Your code here.
-	//panic("flush_block not implemented");
+}
+
+void
+bc_stat(struct Fsstat *st)
+{
+	st->st_bc_hits = nhits;
+	st->st_bc_misses = nmisses;
+	st->st_bc_flushes = nflushes;
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -124,7 +354,11 @@ void
 bc_init(void)
 {
 	struct Super super;
-	set_pgfault_handler(bc_pgfault);
+	int r;
+
+	add_pgfault_hook(bc_pgfault);
+	if ((r = sys_irq_listen(IRQ_IDE)) < 0)
+		panic("bc_init: sys_irq_listen: %e", r);
 	check_bc();
 
 	// cache the super block by reading it once
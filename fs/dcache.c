@@ -0,0 +1,112 @@
+#include <inc/string.h>
+
+#include "fs.h"
+
+// Path lookup cache.  It maps (directory, name) to that directory's
+// entry for name, or records that the directory has no such entry.
+// walk_path consults it before searching a directory, so resolving a
+// hot path costs one probe per component.  Cached struct File pointers
+// point into the block cache and stay valid because directory entries
+// never move.  file_create and file_remove keep the cache current.
+
+#define DCACHE_NSETS	256
+#define DCACHE_WAYS	4
+
+struct Dentry {
+	struct File *d_dir;		// parent directory, 0 if slot unused
+	struct File *d_file;		// the entry, 0 if name is absent
+	uint32_t d_hash;		// dir_hash(d_name)
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[DCACHE_NSETS][DCACHE_WAYS];
+static uint8_t dcache_victim[DCACHE_NSETS];	// round-robin replacement
+
+static uint32_t dcache_hits, dcache_neg_hits, dcache_misses;
+
+// Return the index of the set that caches name (with hash 'hash') in dir.
+static uint32_t
+dcache_set(struct File *dir, uint32_t hash)
+{
+	return ((hash ^ ((uintptr_t) dir >> 8)) * 2654435761U >> 16) % DCACHE_NSETS;
+}
+
+static struct Dentry *
+dcache_find(struct File *dir, const char *name, uint32_t hash)
+{
+	struct Dentry *set = dcache[dcache_set(dir, hash)];
+	int i;
+
+	for (i = 0; i < DCACHE_WAYS; i++)
+		if (set[i].d_dir == dir && set[i].d_hash == hash
+		    && strcmp(set[i].d_name, name) == 0)
+			return &set[i];
+	return 0;
+}
+
+// Look up name in dir.  Returns 1 and sets *pf if the cache knows the
+// answer (*pf is 0 if dir has no such entry), or 0 on a miss.
+bool
+dcache_lookup(struct File *dir, const char *name, struct File **pf)
+{
+	struct Dentry *d = dcache_find(dir, name, dir_hash(name));
+
+	if (!d) {
+		dcache_misses++;
+		return 0;
+	}
+	if (d->d_file)
+		dcache_hits++;
+	else
+		dcache_neg_hits++;
+	*pf = d->d_file;
+	return 1;
+}
+
+// Record that name in dir is f, or absent if f is 0.
+void
+dcache_insert(struct File *dir, const char *name, struct File *f)
+{
+	uint32_t hash = dir_hash(name), set;
+	struct Dentry *d;
+
+	if (!(d = dcache_find(dir, name, hash))) {
+		set = dcache_set(dir, hash);
+		d = &dcache[set][dcache_victim[set]++ % DCACHE_WAYS];
+		d->d_dir = dir;
+		d->d_hash = hash;
+		strcpy(d->d_name, name);
+	}
+	d->d_file = f;
+}
+
+// Forget what is cached about name in dir.
+void
+dcache_invalidate(struct File *dir, const char *name)
+{
+	struct Dentry *d = dcache_find(dir, name, dir_hash(name));
+
+	if (d)
+		d->d_dir = 0;
+}
+
+// Forget everything cached about the entries of dir, which is going
+// away; its slot may later hold an unrelated directory.
+void
+dcache_invalidate_dir(struct File *dir)
+{
+	int i, j;
+
+	for (i = 0; i < DCACHE_NSETS; i++)
+		for (j = 0; j < DCACHE_WAYS; j++)
+			if (dcache[i][j].d_dir == dir)
+				dcache[i][j].d_dir = 0;
+}
+
+void
+dcache_stat(struct Fsstat *st)
+{
+	st->st_dcache_hits = dcache_hits;
+	st->st_dcache_neg_hits = dcache_neg_hits;
+	st->st_dcache_misses = dcache_misses;
+}
@@ -14,6 +14,10 @@ check_super(void)
 	if (super->s_magic != FS_MAGIC)
 		panic("bad file system magic number");
 
+	if (super->s_version != FS_VERSION)
+		panic("file system format version %d, expected %d",
+		      super->s_version, FS_VERSION);
+
 	if (super->s_nblocks > DISKSIZE/BLKSIZE)
 		panic("file system is too large");
 
@@ -24,6 +28,15 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+// In-memory summary of the bitmap: bit i is set iff bitmap word i has
+// at least one free block.  One summary word covers 1024 blocks, so a
+// search skips full regions of the disk without touching their bitmap
+// pages.  Built by bitmap_summary_init and kept current by
+// alloc_block_near and free_block.
+static uint32_t free_summary[DISKSIZE / BLKSIZE / 32 / 32];
+static uint32_t nfree_blocks;	// free blocks on the whole disk
+static uint32_t alloc_cursor;	// next-fit start for alloc_block
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
@@ -43,42 +56,130 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	// A snapshot still has it
+	if (block_is_frozen(blockno))
+		return;
+	if (!(bitmap[blockno/32] & (1<<(blockno%32))))
+		nfree_blocks++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	free_summary[blockno/32/32] |= 1<<(blockno/32%32);
+}
+
+// Return the index of the first bitmap word at or after 'w' that has a
+// free block, or -1 if there is none before 'nwords'.
+static int
+summary_find(uint32_t w, uint32_t nwords)
+{
+	uint32_t s, bits;
+
+	for (s = w / 32; s * 32 < nwords; s++) {
+		bits = free_summary[s];
+		if (s == w / 32)
+			bits &= ~0U << (w % 32);
+		if (bits) {
+			w = s * 32 + __builtin_ctz(bits);
+			return w < nwords ? w : -1;
+		}
+	}
+	return -1;
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// Take a free block out of the bitmap, preferring block 'goal' itself
+// and then the first free block after it, wrapping around to the start
+// of the disk.  Does not flush the bitmap.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
-int
-alloc_block(void)
+static int
+bitmap_take(uint32_t goal)
 {
 	// The bitmap consists of one or more blocks.  A single bitmap block
 	// contains the in-use bits for BLKBITSIZE blocks.  There are
 	// super->s_nblocks blocks in the disk altogether.
-	int blockno;
+	uint32_t nwords, word, blockno;
+	int w;
+
 	assert(super);
-	for ( blockno = 0; blockno < super->s_nblocks; blockno += 32 ){
-		if ( !bitmap[blockno/32] ) continue;
-
-		uint32_t thisint = bitmap[blockno/32];
-		for ( int i = 0; i < 32; i++ ){
-			if ( thisint & (1 << i) ){
-				bitmap[blockno/32] &= ~(1 << i);
-				flush_block(bitmap + blockno / 32);
-				return blockno + i;
-			}
-		}
-		assert(0);
-	}
+	if (nfree_blocks == 0)
+		return -E_NO_DISK;
+	if (goal >= super->s_nblocks)
+		goal = 0;
+	nwords = (super->s_nblocks + 31) / 32;
+
+	w = goal / 32;
+	if (!(bitmap[w] & (~0U << (goal % 32)))
+	    && (w = summary_find(w + 1, nwords)) < 0
+	    && (w = summary_find(0, nwords)) < 0)
+		panic("alloc_block: free count is %d but the summary is empty",
+		      nfree_blocks);
+
+	word = bitmap[w];
+	if (w == goal / 32 && (word & (~0U << (goal % 32))))
+		word &= ~0U << (goal % 32);
+	blockno = w * 32 + __builtin_ctz(word);
+
+	bitmap[w] &= ~(1U << (blockno % 32));
+	if (!bitmap[w])
+		free_summary[w / 32] &= ~(1U << (w % 32));
+	nfree_blocks--;
+	return blockno;
+}
 
-	// LAB 5: Your code here.
-	//panic("alloc_block not implemented");
-	return -E_NO_DISK;
+// Allocate a free block near 'goal' (see bitmap_take).  Starting near a
+// related block (for a file, the one holding the previous file block)
+// keeps files contiguous on disk.  When you allocate a block,
+// immediately flush the changed bitmap block to disk.
+//
+// Return block number allocated on success,
+// -E_NO_DISK if we are out of blocks.
+int
+alloc_block_near(uint32_t goal)
+{
+	int r;
+
+	if ((r = bitmap_take(goal)) >= 0)
+		flush_block(&bitmap[r / 32]);
+	return r;
+}
+
+// Return the number of free blocks on the disk.
+uint32_t
+free_block_count(void)
+{
+	return nfree_blocks;
+}
+
+// Allocate a block with no particular placement in mind, continuing
+// where the previous such allocation left off.
+int
+alloc_block(void)
+{
+	int r;
+
+	if ((r = alloc_block_near(alloc_cursor)) >= 0)
+		alloc_cursor = r + 1;
+	return r;
+}
+
+// Build the bitmap summary and free count.  Bits past the end of the
+// disk are cleared first so they can never be handed out.
+static void
+bitmap_summary_init(void)
+{
+	uint32_t w, word, nwords;
+
+	nwords = (super->s_nblocks + 31) / 32;
+	if (super->s_nblocks % 32)
+		bitmap[nwords - 1] &= (1U << (super->s_nblocks % 32)) - 1;
+
+	memset(free_summary, 0, sizeof(free_summary));
+	nfree_blocks = 0;
+	for (w = 0; w < nwords; w++)
+		if (bitmap[w]) {
+			free_summary[w / 32] |= 1U << (w % 32);
+			for (word = bitmap[w]; word; word &= word - 1)
+				nfree_blocks++;
+		}
 }
 
 // Validate the file system bitmap.
@@ -127,14 +228,39 @@ fs_init(void)
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
-	
+	bitmap_summary_init();
+	snap_init();
+}
+
+// Set *pind to the in-memory address of the indirect block whose block
+// number is stored in *pbno.  If there is no such block yet and 'alloc'
+// is set, allocate and clear one and record it in *pbno.
+//
+// Returns 0 on success, -E_NOT_FOUND if the block is missing and alloc
+// was 0, or -E_NO_DISK if the disk is full.
+static int
+indirect_block(uint32_t *pbno, uint32_t **pind, bool alloc)
+{
+	int r;
+
+	if (!*pbno) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block()) < 0)
+			return r;
+		bc_zero(r);
+		*pbno = r;
+	}
+	*pind = (uint32_t *) diskaddr(*pbno);
+	return 0;
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the blocks hanging off the
+// double-indirect block.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -142,68 +268,150 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLOCKS).
 //
 // Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
-       	if ( filebno >= NDIRECT + NINDIRECT ){
-       		return -E_INVAL;
-	}
-	if ( filebno < NDIRECT ){
+	int r;
+	uint32_t *ind, bno;
+
+	if (filebno >= MAXFILEBLOCKS)
+		return -E_INVAL;
+	if (filebno < NDIRECT) {
 		*ppdiskbno = f->f_direct + filebno;
 		return 0;
 	}
 
-	// filebno >= NDIRECT
-	if ( !f->f_indirect ){
-		if ( !alloc ){
-			return -E_NOT_FOUND;
-		}
-		int blk;
-		if ( (blk = alloc_block()) < 0 ){
-			return -E_NO_DISK;
-		}
-		memset(diskaddr(blk), 0, BLKSIZE);
-		f->f_indirect = blk;
+	// struct File is packed, so its indirect block numbers go
+	// through a local, written back only when newly allocated.
+	filebno -= NDIRECT;
+	if (filebno < NINDIRECT) {
+		bno = f->f_indirect;
+		if ((r = indirect_block(&bno, &ind, alloc)) < 0)
+			return r;
+		if (!f->f_indirect)
+			f->f_indirect = bno;
+		*ppdiskbno = &ind[filebno];
+		return 0;
 	}
-	*ppdiskbno = (uint32_t*)diskaddr(f->f_indirect) + filebno - NDIRECT;
+
+	filebno -= NINDIRECT;
+	bno = f->f_dindirect;
+	if ((r = indirect_block(&bno, &ind, alloc)) < 0)
+		return r;
+	if (!f->f_dindirect)
+		f->f_dindirect = bno;
+	if ((r = indirect_block(&ind[filebno / NINDIRECT], &ind, alloc)) < 0)
+		return r;
+	*ppdiskbno = &ind[filebno % NINDIRECT];
 	return 0;
-       // LAB 5: Your code here.
-       //panic("file_block_walk not implemented");
+}
+
+// Does f keep its data in f_inline?
+bool
+file_is_inline(struct File *f)
+{
+	return f->f_type == FTYPE_REG && f->f_size <= FILEINLINE && !f->f_direct[0];
 }
 
 // Set *blk to the address in memory where the filebno'th
 // block of file 'f' would be mapped.
+// A newly allocated block is placed right after the file's previous
+// block whenever that one is free, so sequential writes lay files out
+// contiguously.  It starts out zeroed, so that the parts of it not yet
+// written read as zero, like a hole.  A block shared with a snapshot is
+// replaced with a private copy first, since the caller may write it.
+// Giving an inline file its first block moves the inline data there.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-       	int r;
-       	uint32_t *bno_store;
-       	if ( (r = file_block_walk(f, filebno, &bno_store, 1)) < 0 ){
-       		return r;
-	}
-	if ( !*bno_store ){
-		if ( (r = alloc_block()) < 0 ){
+	int r;
+	uint32_t *bno_store, *prev, goal;
+	bool uninline;
+
+	if ((r = file_block_walk(f, filebno, &bno_store, 1)) < 0)
+		return r;
+	if (!*bno_store) {
+		goal = 0;
+		if (filebno > 0 && file_block_walk(f, filebno - 1, &prev, 0) == 0
+		    && *prev)
+			goal = *prev + 1;
+		if ((r = alloc_block_near(goal)) < 0)
 			return r;
+		bc_zero(r);
+		uninline = filebno == 0 && file_is_inline(f) && f->f_size > 0;
+		// Set before flushing f below, so the pointer reaches the disk
+		*bno_store = r;
+		if (uninline) {
+			memmove(diskaddr(r), f->f_inline, f->f_size);
+			flush_block(diskaddr(r));
+			memset(f->f_inline, 0, FILEINLINE);
+			flush_block(f);
 		}
+	} else if (block_is_frozen(*bno_store)) {
+		if ((r = alloc_block_near(*bno_store)) < 0)
+			return r;
+		bc_zero(r);
+		memmove(diskaddr(r), diskaddr(*bno_store), BLKSIZE);
 		*bno_store = r;
 	}
 	*blk = (char*)diskaddr(*bno_store);
-       	return 0;
-       // LAB 5: Your code here.
-       //panic("file_get_block not implemented");
+	return 0;
+}
+
+// Like file_get_block, but never allocates anything.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if the block is a hole.
+//	-E_INVAL if filebno is out of range.
+int
+file_find_block(struct File *f, uint32_t filebno, char **blk)
+{
+	int r;
+	uint32_t *bno_store;
+
+	if ((r = file_block_walk(f, filebno, &bno_store, 0)) < 0)
+		return r;
+	if (!*bno_store)
+		return -E_NOT_FOUND;
+	*blk = (char*)diskaddr(*bno_store);
+	return 0;
+}
+
+// Return the number of hash levels in directory 'dir'.
+static uint32_t
+dir_nlevels(struct File *dir)
+{
+	uint32_t nblock, nlevels;
+
+	// We maintain the invariant that the size of a directory-file
+	// is always 2^L - 1 blocks for L levels.
+	assert((dir->f_size % BLKSIZE) == 0);
+	nblock = dir->f_size / BLKSIZE;
+	assert(((nblock + 1) & nblock) == 0);
+	for (nlevels = 0; nblock; nlevels++)
+		nblock >>= 1;
+	return nlevels;
+}
+
+// Set *blk to the block of level 'level' of dir that entries hashing to
+// 'hash' may live in.
+static int
+dir_bucket(struct File *dir, uint32_t hash, uint32_t level, struct File **blk)
+{
+	uint32_t n = 1 << level;
+
+	return file_get_block(dir, n - 1 + (hash & (n - 1)), (char **) blk);
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
+// Only one block per level of the directory is examined.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
@@ -211,19 +419,14 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
-	char *blk;
+	uint32_t hash, level, nlevels, j;
 	struct File *f;
 
-	// Search dir for name.
-	// We maintain the invariant that the size of a directory-file
-	// is always a multiple of the file system's block size.
-	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+	hash = dir_hash(name);
+	nlevels = dir_nlevels(dir);
+	for (level = 0; level < nlevels; level++) {
+		if ((r = dir_bucket(dir, hash, level, &f)) < 0)
 			return r;
-		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
 				*file = &f[j];
@@ -233,32 +436,39 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir where an entry
+// called 'name' may be stored, adding a level to dir if none is free.
+// The caller is responsible for filling in the File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
+	uint32_t hash, level, nlevels, i, j;
 	char *blk;
 	struct File *f;
 
-	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+	hash = dir_hash(name);
+	nlevels = dir_nlevels(dir);
+	for (level = 0; level < nlevels; level++) {
+		if ((r = dir_bucket(dir, hash, level, &f)) < 0)
 			return r;
-		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
 				*file = &f[j];
 				return 0;
 			}
 	}
-	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
+
+	// Every candidate block is full: add level 'nlevels', doubling the
+	// directory.  Its blocks must start out empty.
+	for (i = 0; i < (1 << nlevels); i++) {
+		if ((r = file_get_block(dir, (1 << nlevels) - 1 + i, &blk)) < 0)
+			return r;
+		memset(blk, 0, BLKSIZE);
+	}
+	dir->f_size = ((2 << nlevels) - 1) * BLKSIZE;
+	if ((r = dir_bucket(dir, hash, nlevels, &f)) < 0)
 		return r;
-	f = (struct File*) blk;
 	*file = &f[0];
 	return 0;
 }
@@ -272,7 +482,8 @@ skip_slash(const char *p)
 	return p;
 }
 
-// Evaluate a path name, starting at the root.
+// Evaluate a path name, starting at the root, or at a snapshot's root
+// for paths under /.snap/NAME.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
 // If we cannot find the file but find the directory
@@ -288,14 +499,17 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 
 	// if (*path != '/')
 	//	return -E_BAD_PATH;
-	path = skip_slash(path);
+	if (pdir)
+		*pdir = 0;
+	*pf = 0;
+
 	f = &super->s_root;
+	if ((r = snap_lookup(&path, &f)) < 0)
+		return r;
+	path = skip_slash(path);
 	dir = 0;
 	name[0] = 0;
 
-	if (pdir)
-		*pdir = 0;
-	*pf = 0;
 	while (*path != '\0') {
 		dir = f;
 		p = path;
@@ -310,7 +524,13 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if (dcache_lookup(dir, name, &f))
+			r = f ? 0 : -E_NOT_FOUND;
+		else if ((r = dir_lookup(dir, name, &f)) == 0)
+			dcache_insert(dir, name, f);
+		else if (r == -E_NOT_FOUND)
+			dcache_insert(dir, name, 0);
+		if (r < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -339,18 +559,26 @@ file_create(const char *path, struct File **pf)
 {
 	char name[MAXNAMELEN];
 	int r;
+	off_t oldsize;
 	struct File *dir, *f;
 
+	if (snap_lookup(&path, &f))
+		return -E_INVAL;	// snapshots are read-only
 	if ((r = walk_path(path, &dir, &f, name)) == 0)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	oldsize = dir->f_size;
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
 
 	strcpy(f->f_name, name);
+	dcache_insert(dir, name, f);
 	*pf = f;
-	file_flush(dir);
+	if (dir->f_size != oldsize)
+		file_flush(dir);
+	else
+		flush_block(f);
 	return 0;
 }
 
@@ -362,8 +590,21 @@ file_open(const char *path, struct File **pf)
 	return walk_path(path, 0, pf, 0);
 }
 
+// Move f's inline data, if any, to a first block, before f grows past
+// FILEINLINE bytes or gets blocks some other way.
+static int
+file_uninline(struct File *f)
+{
+	char *blk;
+
+	if (!file_is_inline(f) || f->f_size == 0)
+		return 0;
+	return file_get_block(f, 0, &blk);
+}
+
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
+// Holes read as zeros and stay holes.
 // Returns the number of bytes read, < 0 on error.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
@@ -376,11 +617,22 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
+	if (file_is_inline(f)) {
+		memmove(buf, f->f_inline + offset, count);
+		return count;
+	}
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
-			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		if ((r = file_find_block(f, pos / BLKSIZE, &blk)) == -E_NOT_FOUND) {
+			memset(buf, 0, bn);
+			pos += bn;
+			buf += bn;
+			continue;
+		}
+		if (r < 0)
+			return r;
+		bc_fetch(blk);
 		memmove(buf, blk + pos % BLKSIZE, bn);
 		pos += bn;
 		buf += bn;
@@ -406,9 +658,16 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
+	if (file_is_inline(f)) {
+		memmove(f->f_inline + offset, buf, count);
+		flush_block(f);
+		return count;
+	}
+
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
+		bc_fetch(blk);
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(blk + pos % BLKSIZE, buf, bn);
 		pos += bn;
@@ -418,72 +677,202 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error.
-static int
-file_free_block(struct File *f, uint32_t filebno)
+// Free the blocks named in bnos[from] through bnos[n-1], skipping
+// holes, and clear those entries.
+static void
+free_blocks(uint32_t *bnos, uint32_t from, uint32_t n)
 {
-	int r;
-	uint32_t *ptr;
-
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
-	if (*ptr) {
-		free_block(*ptr);
-		*ptr = 0;
-	}
-	return 0;
+	for (; from < n; from++)
+		if (bnos[from]) {
+			free_block(bnos[from]);
+			bnos[from] = 0;
+		}
 }
 
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// Rather than look up each block past the new end, sweep the block
+// pointer arrays directly: the tail of f_direct, the tail of the
+// indirect block, and the tail of each second-level block hanging off
+// the double-indirect block.  Indirect blocks that no longer map
+// anything are freed too.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
-
-	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
-	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %e", r);
+	uint32_t nblocks, first, i, *ind, *dind;
+
+	nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (nblocks < NDIRECT)
+		free_blocks(f->f_direct + nblocks, 0, NDIRECT - nblocks);
+
+	first = nblocks > NDIRECT ? nblocks - NDIRECT : 0;
+	if (f->f_indirect && first < NINDIRECT) {
+		free_blocks((uint32_t *) diskaddr(f->f_indirect), first, NINDIRECT);
+		if (first == 0) {
+			free_block(f->f_indirect);
+			f->f_indirect = 0;
+		}
+	}
 
-	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
+	first = nblocks > NDIRECT + NINDIRECT ? nblocks - NDIRECT - NINDIRECT : 0;
+	if (f->f_dindirect) {
+		dind = (uint32_t *) diskaddr(f->f_dindirect);
+		for (i = first / NINDIRECT; i < NINDIRECT; i++) {
+			if (!dind[i])
+				continue;
+			ind = (uint32_t *) diskaddr(dind[i]);
+			if (i == first / NINDIRECT && first % NINDIRECT) {
+				free_blocks(ind, first % NINDIRECT, NINDIRECT);
+				continue;
+			}
+			free_blocks(ind, 0, NINDIRECT);
+			free_block(dind[i]);
+			dind[i] = 0;
+		}
+		if (first == 0) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
 	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// Extending allocates nothing: the new bytes are a hole.  Truncating
+// zeroes the rest of the new last block, so that growing the file again
+// does not bring old data back.  Inline data moves to a block when the
+// file outgrows f_inline.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	int r;
+	char *blk;
+
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	if (newsize > FILEINLINE && (r = file_uninline(f)) < 0)
+		return r;
+	if (file_is_inline(f) && f->f_size > newsize)
+		memset(f->f_inline + newsize, 0, f->f_size - newsize);
+	else if (f->f_size > newsize) {
 		file_truncate_blocks(f, newsize);
+		if (newsize % BLKSIZE
+		    && file_find_block(f, newsize / BLKSIZE, &blk) == 0
+		    && file_get_block(f, newsize / BLKSIZE, &blk) == 0) {
+			bc_fetch(blk);
+			memset(blk + newsize % BLKSIZE, 0, BLKSIZE - newsize % BLKSIZE);
+		}
+	}
 	f->f_size = newsize;
 	flush_block(f);
 	return 0;
 }
 
+// Back the bytes [offset, offset+len) of f with disk blocks, zeroing
+// the holes in that range, and extend f to cover them.  The new blocks
+// are laid out one after another from just past the block before the
+// range, and the bitmap is flushed once at the end instead of after
+// every block, so a file preallocated this way is contiguous whenever
+// the free space allows.  On error f is left as it was, though blocks
+// in holes inside its old size may have been filled.  Directories
+// cannot be allocated this way (-E_INVAL).
+int
+file_allocate(struct File *f, off_t offset, off_t len)
+{
+	int r = 0;
+	off_t oldsize = f->f_size;
+	uint32_t bno, end, goal, *ptr, lo = ~0U, hi = 0, i;
+
+	if (offset < 0 || len <= 0 || len > MAXFILESIZE - offset
+	    || f->f_type == FTYPE_DIR)
+		return -E_INVAL;
+	if ((r = file_uninline(f)) < 0)
+		return r;
+	if (offset + len > f->f_size)
+		f->f_size = offset + len;
+
+	goal = alloc_cursor;
+	if (offset >= BLKSIZE
+	    && file_block_walk(f, offset / BLKSIZE - 1, &ptr, 0) == 0 && *ptr)
+		goal = *ptr + 1;
+	end = (offset + len + BLKSIZE - 1) / BLKSIZE;
+	for (bno = offset / BLKSIZE; bno < end; bno++) {
+		if ((r = file_block_walk(f, bno, &ptr, 1)) < 0)
+			break;
+		if (!*ptr) {
+			if ((r = bitmap_take(goal)) < 0)
+				break;
+			bc_zero(r);
+			*ptr = r;
+			lo = MIN(lo, *ptr / BLKBITSIZE);
+			hi = MAX(hi, *ptr / BLKBITSIZE);
+		}
+		goal = *ptr + 1;
+	}
+	for (i = lo; i <= hi; i++)
+		flush_block(diskaddr(2 + i));
+
+	if (r < 0) {
+		file_set_size(f, oldsize);
+		return r;
+	}
+	flush_block(f);
+	return 0;
+}
+
+// Remove "path".  A directory can only be removed once it is empty;
+// its blocks, like a regular file's, go back to the free pool.
+int
+file_remove(const char *path)
+{
+	int r;
+	uint32_t i, j;
+	char *blk;
+	struct File *dir, *f, *ents;
+
+	if (snap_lookup(&path, &f))
+		return -E_INVAL;	// snapshots are read-only
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (dir == 0)
+		return -E_INVAL;	// the root
+
+	if (f->f_type == FTYPE_DIR)
+		for (i = 0; i < f->f_size / BLKSIZE; i++) {
+			if ((r = file_get_block(f, i, &blk)) < 0)
+				return r;
+			ents = (struct File *) blk;
+			for (j = 0; j < BLKFILES; j++)
+				if (ents[j].f_name[0] != '\0')
+					return -E_NOT_EMPTY;
+		}
+
+	dcache_invalidate(dir, f->f_name);
+	if (f->f_type == FTYPE_DIR)
+		dcache_invalidate_dir(f);
+	file_truncate_blocks(f, 0);
+	memset(f, 0, sizeof(struct File));
+	flush_block(f);
+	return 0;
+}
+
 // Flush the contents and metadata of file f out to disk.
 // Loop over all the blocks in file.
 // Translate the file block number into a disk block number
 // and then check whether that disk block is dirty.  If so, write it out.
+// When there are no more dirty blocks in the whole cache than f has
+// blocks, writing them all is cheaper than walking f.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
+	int i, n = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	uint32_t *pdiskbno, *dind;
 
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
+	if (bc_ndirty() <= n) {
+		bc_sync();
+		return;
+	}
+	for (i = 0; i < n; i++) {
 		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
 		    pdiskbno == NULL || *pdiskbno == 0)
 			continue;
@@ -492,15 +881,21 @@ file_flush(struct File *f)
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	if (f->f_dindirect) {
+		dind = (uint32_t *) diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (dind[i])
+				flush_block(diskaddr(dind[i]));
+		flush_block(dind);
+	}
 }
 
 
-// Sync the entire file system.  A big hammer.
+// Sync the entire file system.  A big hammer, but it only costs as
+// much as there are dirty blocks.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
 }
 
@@ -11,6 +11,9 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Staging page for the disk read in flight (see bc_fetch) */
+#define BCTEMP		((void *) 0x0fffe000)
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
@@ -18,31 +21,66 @@ uint32_t *bitmap;		// bitmap blocks mapped in memory
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
+bool	ide_busy(void);
+int	ide_read_start(uint32_t secno, size_t nsecs);
+int	ide_read_finish(void *dst, size_t nsecs);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+void	ide_stat(struct Fsstat *st);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_fetch(void *addr);
+void	bc_zero(uint32_t blockno);
+void	bc_sync(void);
+uint32_t	bc_ndirty(void);
+void	bc_drop_clean(void);
 void	bc_init(void);
+void	bc_stat(struct Fsstat *st);
+extern int bc_nwaiting;
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_find_block(struct File *f, uint32_t file_blockno, char **pblk);
+bool	file_is_inline(struct File *f);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
+int	file_allocate(struct File *f, off_t offset, off_t len);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
 void	fs_sync(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
+void	free_block(uint32_t blockno);
+uint32_t free_block_count(void);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+
+/* dcache.c */
+bool	dcache_lookup(struct File *dir, const char *name, struct File **pf);
+void	dcache_insert(struct File *dir, const char *name, struct File *f);
+void	dcache_invalidate(struct File *dir, const char *name);
+void	dcache_invalidate_dir(struct File *dir);
+void	dcache_stat(struct Fsstat *st);
+
+/* snap.c */
+bool	block_is_frozen(uint32_t blockno);
+int	snap_lookup(const char **path, struct File **root);
+int	snap_create(const char *name);
+int	snap_delete(const char *name);
+void	snap_init(void);
+
+/* trace.c */
+void	trace(uint16_t event, uint16_t type, uint32_t arg);
+int	trace_read(uint32_t pos, struct Fsret_trace *ret);
 
 /* test.c */
 void	fs_test(void);
@@ -1,5 +1,13 @@
 /*
  * JOS file system format
+ *
+ * Builds the image in two passes.  The first, serial, pass lays out
+ * every file and directory: each file's data blocks are contiguous and
+ * placed in the order the files are named, and directories of any size
+ * get the hashed layout the file server expects.  The second pass
+ * copies file contents into their blocks using several threads.  Since
+ * all placement is decided before any copying starts, the image is the
+ * same bit for bit however the copies are scheduled.
  */
 
 // We don't actually want to define off_t!
@@ -14,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -32,7 +41,21 @@ typedef int bool;
 #include <inc/fs.h>
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
-#define MAX_DIR_ENTS 128
+// Largest disk the file server can map (DISKSIZE in fs/fs.h)
+#define MAX_NBLOCKS (0xC0000000 / BLKSIZE)
+#define MAX_THREADS 64
+
+// A file or directory to put in the image, as named on the command line
+// or in the manifest.
+struct Node
+{
+	char name[MAXNAMELEN];
+	const char *src;		// host file, or NULL for a directory
+	uint32_t size;			// size of src
+	struct Node *child;		// directory contents, in the order named
+	struct Node *next;		// next entry in the same directory
+	int nchild;
+};
 
 struct Dir
 {
@@ -41,6 +64,19 @@ struct Dir
 	int n;
 };
 
+// A file's contents waiting to be copied into the image
+struct Copy
+{
+	const char *src;
+	char *dst;
+	uint32_t size;
+};
+
+struct Copy *copies;
+int ncopies, maxcopies;
+int nextcopy;			// next copy to hand out; under copylock
+pthread_mutex_t copylock = PTHREAD_MUTEX_INITIALIZER;
+
 uint32_t nblocks;
 char *diskmap, *diskpos;
 struct Super *super;
@@ -111,6 +147,7 @@ opendisk(const char *name)
 	super = alloc(BLKSIZE);
 	super->s_magic = FS_MAGIC;
 	super->s_nblocks = nblocks;
+	super->s_version = FS_VERSION;
 	super->s_root.f_type = FTYPE_DIR;
 	strcpy(super->s_root.f_name, "/");
 
@@ -134,24 +171,38 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	uint32_t i, j, n, *ind, *dind;
+
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
+	n = ROUNDUP(len, BLKSIZE) / BLKSIZE;
+	for (i = 0; i < n && i < NDIRECT; ++i)
 		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
+	if (i < n) {
+		ind = alloc(BLKSIZE);
 		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
+		for (; i < n && i < NDIRECT + NINDIRECT; ++i)
 			ind[i - NDIRECT] = start + i;
 	}
+	if (i < n) {
+		dind = alloc(BLKSIZE);
+		f->f_dindirect = blockof(dind);
+		for (; i < n; ++i) {
+			j = i - NDIRECT - NINDIRECT;
+			if (j % NINDIRECT == 0) {
+				ind = alloc(BLKSIZE);
+				dind[j / NINDIRECT] = blockof(ind);
+			}
+			ind[j % NINDIRECT] = start + i;
+		}
+	}
 }
 
 void
-startdir(struct File *f, struct Dir *dout)
+startdir(struct File *f, struct Dir *dout, int nents)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	if (!(dout->ents = calloc(nents ? nents : 1, sizeof *dout->ents)))
+		panic("out of memory");
 	dout->n = 0;
 }
 
@@ -159,68 +210,241 @@ struct File *
 diradd(struct Dir *d, uint32_t type, const char *name)
 {
 	struct File *out = &d->ents[d->n++];
-	if (d->n > MAX_DIR_ENTS)
-		panic("too many directory entries");
 	strcpy(out->f_name, name);
 	out->f_type = type;
 	return out;
 }
 
+// Return the block of level 'level' in a directory image where entries
+// hashing to 'hash' live.
+struct File *
+dirbucket(struct File *blocks, uint32_t hash, uint32_t level)
+{
+	uint32_t n = 1 << level;
+
+	return blocks + (n - 1 + (hash & (n - 1))) * BLKFILES;
+}
+
 void
 finishdir(struct Dir *d)
 {
-	int size = d->n * sizeof(struct File);
-	struct File *start = alloc(size);
-	memmove(start, d->ents, size);
-	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	uint32_t nlevels, level, hash, i, j, size;
+	struct File *blocks, *b, *slot;
+
+	// Place the entries exactly as the file server's dir_alloc_file
+	// would, adding a level whenever an entry finds no free slot.
+	blocks = NULL;
+	nlevels = 0;
+	for (i = 0; i < d->n; i++) {
+		hash = dir_hash(d->ents[i].f_name);
+		slot = NULL;
+		for (level = 0; level < nlevels && !slot; level++) {
+			b = dirbucket(blocks, hash, level);
+			for (j = 0; j < BLKFILES && !slot; j++)
+				if (b[j].f_name[0] == '\0')
+					slot = &b[j];
+		}
+		if (!slot) {
+			if (!(blocks = realloc(blocks, ((2 << nlevels) - 1) * BLKSIZE)))
+				panic("out of memory");
+			memset(dirbucket(blocks, 0, nlevels), 0, (1 << nlevels) * BLKSIZE);
+			slot = dirbucket(blocks, hash, nlevels);
+			nlevels++;
+		}
+		*slot = d->ents[i];
+	}
+
+	size = ((1 << nlevels) - 1) * BLKSIZE;
+	if (size) {
+		b = alloc(size);
+		memmove(b, blocks, size);
+		finishfile(d->f, blockof(b), size);
+	}
+	free(blocks);
 	free(d->ents);
 	d->ents = NULL;
 }
 
+// Find or add the entry 'name' in directory 'dir'.  'src' is the host
+// file for a regular file, or NULL for a directory.  Returns the
+// existing entry if there is one.
+struct Node *
+dirnode(struct Node *dir, const char *name, const char *src)
+{
+	struct Node *n, **pn;
+
+	if (strlen(name) >= MAXNAMELEN)
+		panic("%s: name too long", name);
+	for (pn = &dir->child; (n = *pn); pn = &n->next)
+		if (strcmp(n->name, name) == 0) {
+			// Naming the same file twice is harmless
+			if ((src || n->src) && !(src && n->src && strcmp(src, n->src) == 0))
+				panic("%s named twice", name);
+			return n;
+		}
+	if (!(n = calloc(1, sizeof *n)))
+		panic("out of memory");
+	strcpy(n->name, name);
+	n->src = src;
+	*pn = n;
+	dir->nchild++;
+	return n;
+}
+
+// Add host file 'src' to the image at 'path', creating the directories
+// on the way.  A NULL path means the root directory and src's last path
+// component.
 void
-writefile(struct Dir *dir, const char *name)
+addfile(struct Node *root, const char *src, const char *path)
 {
-	int r, fd;
-	struct File *f;
+	int fd;
 	struct stat st;
-	const char *last;
-	char *start;
+	char name[MAXPATHLEN], *p, *q;
+	struct Node *n;
 
-	if ((fd = open(name, O_RDONLY)) < 0)
-		panic("open %s: %s", name, strerror(errno));
-	if ((r = fstat(fd, &st)) < 0)
-		panic("stat %s: %s", name, strerror(errno));
+	if ((fd = open(src, O_RDONLY)) < 0)
+		panic("open %s: %s", src, strerror(errno));
+	if (fstat(fd, &st) < 0)
+		panic("stat %s: %s", src, strerror(errno));
+	close(fd);
 	if (!S_ISREG(st.st_mode))
-		panic("%s is not a regular file", name);
+		panic("%s is not a regular file", src);
 	if (st.st_size >= MAXFILESIZE)
-		panic("%s too large", name);
-
-	last = strrchr(name, '/');
-	if (last)
-		last++;
-	else
-		last = name;
-
-	f = diradd(dir, FTYPE_REG, last);
-	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
-	finishfile(f, blockof(start), st.st_size);
-	close(fd);
+		panic("%s too large", src);
+
+	if (!path)
+		path = (p = strrchr(src, '/')) ? p + 1 : src;
+	if (strlen(path) >= sizeof name)
+		panic("%s: path too long", path);
+	strcpy(name, path);
+
+	n = root;
+	for (p = name; *p == '/'; p++)
+		/* skip */;
+	while ((q = strchr(p, '/'))) {
+		*q = 0;
+		n = dirnode(n, p, NULL);
+		for (p = q + 1; *p == '/'; p++)
+			/* skip */;
+	}
+	if (!*p)
+		panic("%s: no file name", path);
+	n = dirnode(n, p, src);
+	n->size = st.st_size;
+}
+
+// Read a manifest: one file per line, as "host-path [image-path]".
+// Blank lines and lines starting with '#' are ignored.
+void
+readmanifest(struct Node *root, const char *name)
+{
+	FILE *mf;
+	char line[2 * MAXPATHLEN + 16], src[MAXPATHLEN], path[MAXPATHLEN];
+	int n, lineno = 0;
+
+	if (!(mf = fopen(name, "r")))
+		panic("open %s: %s", name, strerror(errno));
+	while (fgets(line, sizeof line, mf)) {
+		lineno++;
+		n = sscanf(line, "%1023s %1023s", src, path);
+		if (n < 1 || src[0] == '#')
+			continue;
+		addfile(root, strdup(src), n == 2 ? strdup(path) : NULL);
+	}
+	if (ferror(mf))
+		panic("read %s: %s", name, strerror(errno));
+	fclose(mf);
+}
+
+// Lay out directory node 'dir', whose entry in its parent is 'f':
+// allocate blocks for each file's data, recurse into subdirectories,
+// then write the directory's own blocks.  File data is queued to be
+// copied later, except that files of at most FILEINLINE bytes are read
+// into their entries right away and get no blocks.
+void
+layoutdir(struct Node *dir, struct File *f)
+{
+	struct Dir d;
+	struct Node *n;
+	struct File *ent;
+	char *start;
+	int fd;
+
+	startdir(f, &d, dir->nchild);
+	for (n = dir->child; n; n = n->next) {
+		ent = diradd(&d, n->src ? FTYPE_REG : FTYPE_DIR, n->name);
+		if (!n->src) {
+			layoutdir(n, ent);
+			continue;
+		}
+		if (n->size <= FILEINLINE) {
+			if ((fd = open(n->src, O_RDONLY)) < 0)
+				panic("open %s: %s", n->src, strerror(errno));
+			readn(fd, ent->f_inline, n->size);
+			close(fd);
+			ent->f_size = n->size;
+			continue;
+		}
+		start = alloc(n->size);
+		finishfile(ent, blockof(start), n->size);
+		if (ncopies == maxcopies) {
+			maxcopies = maxcopies ? 2 * maxcopies : 64;
+			if (!(copies = realloc(copies, maxcopies * sizeof *copies)))
+				panic("out of memory");
+		}
+		copies[ncopies].src = n->src;
+		copies[ncopies].dst = start;
+		copies[ncopies].size = n->size;
+		ncopies++;
+	}
+	finishdir(&d);
+}
+
+void *
+copythread(void *arg)
+{
+	int fd, i;
+
+	while (1) {
+		pthread_mutex_lock(&copylock);
+		i = nextcopy++;
+		pthread_mutex_unlock(&copylock);
+		if (i >= ncopies)
+			return NULL;
+		if ((fd = open(copies[i].src, O_RDONLY)) < 0)
+			panic("open %s: %s", copies[i].src, strerror(errno));
+		readn(fd, copies[i].dst, copies[i].size);
+		close(fd);
+	}
+}
+
+// Copy all queued file data into the image using 'nthreads' threads.
+void
+copyfiles(int nthreads)
+{
+	pthread_t threads[MAX_THREADS];
+	int i, r;
+
+	for (i = 0; i < nthreads; i++)
+		if ((r = pthread_create(&threads[i], NULL, copythread, NULL)))
+			panic("pthread_create: %s", strerror(r));
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS [-j NTHREADS] [-m MANIFEST] files...\n");
 	exit(2);
 }
 
 int
 main(int argc, char **argv)
 {
-	int i;
+	int i, nthreads;
 	char *s;
-	struct Dir root;
+	struct Node root;
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
@@ -228,17 +452,27 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAX_NBLOCKS)
 		usage();
 
-	opendisk(argv[1]);
-
-	startdir(&super->s_root, &root);
-	for (i = 3; i < argc; i++)
-		writefile(&root, argv[i]);
-	finishdir(&root);
+	memset(&root, 0, sizeof root);
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			nthreads = strtol(argv[++i], &s, 0);
+			if (*s || nthreads < 1)
+				usage();
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			readmanifest(&root, argv[++i]);
+		else
+			addfile(&root, argv[i], NULL);
+	}
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
 
+	opendisk(argv[1]);
+	layoutdir(&root, &super->s_root);
+	copyfiles(nthreads);
 	finishdisk();
 	return 0;
 }
-
@@ -14,13 +14,21 @@
 
 static int diskno = 1;
 
+static uint32_t nsectors_read, nsectors_written;
+static uint64_t wait_cycles;
+
 static int
 ide_wait_ready(bool check_error)
 {
 	int r;
+	uint64_t start;
 
-	while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
-		/* do nothing */;
+	if (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY) {
+		start = read_tsc();
+		while (((r = inb(0x1F7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY)
+			/* do nothing */;
+		wait_cycles += read_tsc() - start;
+	}
 
 	if (check_error && (r & (IDE_DF|IDE_ERR)) != 0)
 		return -1;
@@ -60,11 +68,19 @@ ide_set_disk(int d)
 }
 
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Is the drive still working on the last command?
+bool
+ide_busy(void)
 {
-	int r;
+	return (inb(0x1F7) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY;
+}
 
+// Start reading nsecs sectors at secno.  The data must be collected
+// with ide_read_finish before the drive is given another command;
+// ide_busy says when the first sector is ready.
+int
+ide_read_start(uint32_t secno, size_t nsecs)
+{
 	assert(nsecs <= 256);
 
 	ide_wait_ready(0);
@@ -76,15 +92,35 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
 	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
 
+	return 0;
+}
+
+// Collect the nsecs sectors of the read ide_read_start began.
+int
+ide_read_finish(void *dst, size_t nsecs)
+{
+	int r;
+
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
 			return r;
 		insl(0x1F0, dst, SECTSIZE/4);
+		nsectors_read++;
 	}
 
 	return 0;
 }
 
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	if ((r = ide_read_start(secno, nsecs)) < 0)
+		return r;
+	return ide_read_finish(dst, nsecs);
+}
+
 int
 ide_write(uint32_t secno, const void *src, size_t nsecs)
 {
@@ -105,8 +141,17 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 		if ((r = ide_wait_ready(1)) < 0)
 			return r;
 		outsl(0x1F0, src, SECTSIZE/4);
+		nsectors_written++;
 	}
 
 	return 0;
 }
 
+void
+ide_stat(struct Fsstat *st)
+{
+	st->st_ide_sectors_read = nsectors_read;
+	st->st_ide_sectors_written = nsectors_written;
+	st->st_ide_wait_cycles = wait_cycles;
+}
+
@@ -5,11 +5,12 @@
 
 #include <inc/x86.h>
 #include <inc/string.h>
+#include <arch/thread.h>
 
 #include "fs.h"
 
 
-#define debug 1
+#define debug 0
 
 // The file system server maintains three structures
 // for each open file.
@@ -28,22 +29,110 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// Unused entries are kept on a free list, like the kernel's env_free_list.
+// An entry is in use from openfile_alloc until the last client closes it
+// (FSREQ_CLOSE) or, if its clients exit without closing, until
+// openfile_reclaim finds that only the server still maps its Fd page.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	envid_t o_envid;	// env that opened it; 0 if the entry is free
+	int o_snap;		// 1 + index of its snapshot, 0 if live
+	struct OpenFile *o_free_link;	// next free entry
+	struct OpenFile *o_hash_link;	// next in its openhash bucket
+	bool o_pending;		// Fd page not sent to the client yet
 };
 
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
+// Max number of open files per env.  Files an env inherits through fork
+// count against the env that opened them.
+#define MAXOPENPERENV	512
 #define FILEVA		0xD0000000
 
+// Client windows (see FSREQ_WINDOW), one FSWINDOW_SIZE slot per env
+// slot, mapped above the Fd pages.
+#define WINDOWVA	(FILEVA + MAXOPEN * PGSIZE)
+
+struct Window {
+	envid_t w_owner;	// env whose pages are mapped in this slot
+	int w_npages;		// how many of them have been registered
+};
+
+struct Window windows[NENV];
+// ENVXs of the slots with an owner, so window_reclaim need not scan all
+static uint16_t winslots[NENV];
+static int nwinslots;
+
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
+static struct OpenFile *openfile_free_list;
+
+// Entries with a file, chained by o_file so that file_changed finds a
+// file's entries without scanning opentab.
+#define NOPENHASH	256
+#define OPENHASH(f)	(((uintptr_t) (f) / sizeof(struct File)) % NOPENHASH)
+static struct OpenFile *openhash[NOPENHASH];
+
+// Entries in use by each env, by ENVX.  An env that reuses a slot
+// starts from zero, and entries left by the slot's old env do not count.
+static struct {
+	envid_t envid;
+	int n;
+} nopen[NENV];
+
+// Requests run concurrently, each in its own thread (see serve), and
+// keep their argument pages here, one per request slot, above the
+// client windows.  Above those, each slot has a page in which serve_map
+// builds the page it sends for a file stored inline.
+#define REQVA		(WINDOWVA + NENV * FSWINDOW_SIZE)
+#define MAXREQ		64
+#define STAGEVA		(REQVA + MAXREQ * PGSIZE)
+
+struct Request {
+	envid_t rq_whom;	// client; 0 if the slot is free
+	uint32_t rq_type;	// FSREQ_ code
+	union Fsipc *rq_ipc;	// argument page
+	void *rq_stage;		// page for serve_map's inline copy
+	uint64_t rq_start;	// read_tsc() when it arrived
+};
+
+struct Request requests[MAXREQ];
+int nrequests;			// slots in use
+
+// Request counts and latencies by type, for FSREQ_FSSTAT
+static uint32_t req_count[NFSREQ];
+static uint64_t req_cycles[NFSREQ];
+static uint32_t req_hist[NFSREQ][FSSTAT_NBUCKETS];
+
+// Per-file reader/writer locks.  A request thread can yield while it
+// waits for the disk, so requests that change a file's size or blocks
+// hold its lock exclusively, and reads hold it shared.
+#define NFILELOCK	64
+
+struct FileLock {
+	struct File *l_file;	// 0 if unused
+	int l_readers;
+	bool l_writer;
+};
+
+struct FileLock filelocks[NFILELOCK];
+
+// Request threads waiting for a file lock, for writers to finish, or
+// to reply to a client that is waiting for a page-in.  Like the ones in
+// bc_nwaiting, they cannot run until some other request makes progress;
+// unblocked says whether one may have.
+static int nblocked;
+static bool unblocked;
+
+// What serve_map sends for holes.  Never written.
+static char zeropage[PGSIZE] __attribute__((aligned(PGSIZE)));
 
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
@@ -53,34 +142,143 @@ serve_init(void)
 {
 	int i;
 	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++) {
+	for (i = MAXOPEN - 1; i >= 0; i--) {
 		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd*) va;
-		va += PGSIZE;
+		opentab[i].o_fd = (struct Fd*) (va + i * PGSIZE);
+		opentab[i].o_free_link = openfile_free_list;
+		openfile_free_list = &opentab[i];
+	}
+	for (i = 0; i < MAXREQ; i++) {
+		requests[i].rq_ipc = (union Fsipc*) (REQVA + i * PGSIZE);
+		requests[i].rq_stage = (void *) (STAGEVA + i * PGSIZE);
 	}
 }
 
-// Allocate an open file.
-int
-openfile_alloc(struct OpenFile **o)
-{
-	int i, r;
-
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
+// Lock f, shared or exclusive, yielding until that is possible.
+static struct FileLock *
+file_lock(struct File *f, bool excl)
+{
+	struct FileLock *l, *unused;
+
+	while (1) {
+		unused = 0;
+		for (l = filelocks; l < filelocks + NFILELOCK; l++) {
+			if (l->l_file == f)
+				break;
+			if (!l->l_file && !unused)
+				unused = l;
+		}
+		if (l == filelocks + NFILELOCK && unused) {
+			l = unused;
+			l->l_file = f;
+		}
+		if (l != filelocks + NFILELOCK && !l->l_writer
+		    && (!excl || l->l_readers == 0))
+			break;
+		nblocked++;
+		thread_yield();
+		nblocked--;
+	}
+	if (excl)
+		l->l_writer = 1;
+	else
+		l->l_readers++;
+	return l;
+}
+
+// Is any request holding a file lock exclusively?
+static bool
+writers_active(void)
+{
+	struct FileLock *l;
+
+	for (l = filelocks; l < filelocks + NFILELOCK; l++)
+		if (l->l_file && l->l_writer)
+			return 1;
+	return 0;
+}
+
+static void
+file_unlock(struct FileLock *l, bool excl)
+{
+	unblocked = 1;
+	if (excl)
+		l->l_writer = 0;
+	else
+		l->l_readers--;
+	if (!l->l_writer && l->l_readers == 0)
+		l->l_file = 0;
+}
+
+// Return o to the free list.  The server's mapping of the Fd page goes
+// too, so that the next user of the entry gets a fresh page.
+static void
+openfile_free(struct OpenFile *o)
+{
+	struct OpenFile **pp;
+
+	if (o->o_file) {
+		for (pp = &openhash[OPENHASH(o->o_file)]; *pp != o;
+		     pp = &(*pp)->o_hash_link)
+			/* find o */;
+		*pp = o->o_hash_link;
+	}
+	sys_page_unmap(0, o->o_fd);
+	if (nopen[ENVX(o->o_envid)].envid == o->o_envid)
+		nopen[ENVX(o->o_envid)].n--;
+	o->o_file = 0;
+	o->o_envid = 0;
+	o->o_pending = 0;
+	o->o_free_link = openfile_free_list;
+	openfile_free_list = o;
+}
+
+// Free the entries whose clients all exited without closing them.
+// Pending entries are skipped: only the server maps their Fd page until
+// the reply to the open reaches the client.
+// Returns the number freed.
+static int
+openfile_reclaim(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_envid && !opentab[i].o_pending
+		    && pageref(opentab[i].o_fd) == 1) {
+			openfile_free(&opentab[i]);
+			n++;
 		}
+	return n;
+}
+
+// Allocate an open file for envid.
+int
+openfile_alloc(envid_t envid, struct OpenFile **o)
+{
+	int r;
+
+	if (nopen[ENVX(envid)].envid != envid) {
+		nopen[ENVX(envid)].envid = envid;
+		nopen[ENVX(envid)].n = 0;
 	}
-	return -E_MAX_OPEN;
+
+	// The table full or envid at its limit may just mean that some
+	// clients died with files open; only then is a scan worthwhile.
+	if ((!openfile_free_list || nopen[ENVX(envid)].n >= MAXOPENPERENV)
+	    && openfile_reclaim() == 0)
+		return -E_MAX_OPEN;
+	if (!openfile_free_list || nopen[ENVX(envid)].n >= MAXOPENPERENV)
+		return -E_MAX_OPEN;
+
+	*o = openfile_free_list;
+	if ((r = sys_page_alloc(0, (*o)->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	openfile_free_list = (*o)->o_free_link;
+	(*o)->o_envid = envid;
+	(*o)->o_pending = 1;
+	(*o)->o_fileid += MAXOPEN;
+	nopen[ENVX(envid)].n++;
+	return (*o)->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -96,6 +294,49 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Make f the file of open entry o.
+static void
+openfile_set_file(struct OpenFile *o, struct File *f)
+{
+	o->o_file = f;
+	o->o_hash_link = openhash[OPENHASH(f)];
+	openhash[OPENHASH(f)] = o;
+}
+
+// Tell every client that has f open that its data or size changed, so
+// that they drop anything they have cached (see lib/file.c).
+static void
+file_changed(struct File *f)
+{
+	struct OpenFile *o;
+
+	for (o = openhash[OPENHASH(f)]; o; o = o->o_hash_link)
+		if (o->o_file == f) {
+			o->o_fd->fd_file.size = f->f_size;
+			o->o_fd->fd_file.gen++;
+		}
+}
+
+// Whether some client still has f open.  Entries whose clients exited
+// without closing f are freed on the way, so none is left pointing at f.
+static bool
+file_isopen(struct File *f)
+{
+	struct OpenFile *o, *next;
+	bool open = 0;
+
+	for (o = openhash[OPENHASH(f)]; o; o = next) {
+		next = o->o_hash_link;
+		if (o->o_file == f) {
+			if (o->o_pending || pageref(o->o_fd) > 1)
+				open = 1;
+			else
+				openfile_free(o);
+		}
+	}
+	return open;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -108,6 +349,9 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	int fileid;
 	int r;
 	struct OpenFile *o;
+	struct FileLock *l;
+	const char *p;
+	int snap;
 
 	if (debug)
 		cprintf("serve_open %08x %s 0x%x\n", envid, req->req_path, req->req_omode);
@@ -116,8 +360,16 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	memmove(path, req->req_path, MAXPATHLEN);
 	path[MAXPATHLEN-1] = 0;
 
-	// Find an open file ID
-	if ((r = openfile_alloc(&o)) < 0) {
+	// Snapshots are read-only
+	p = path;
+	if ((snap = snap_lookup(&p, &f)) > 0
+	    && ((req->req_omode & O_ACCMODE) != O_RDONLY
+		|| (req->req_omode & (O_CREAT|O_TRUNC|O_MKDIR))))
+		return -E_INVAL;
+
+	// Find an open file ID first, so that running out of them
+	// leaves no file created
+	if ((r = openfile_alloc(envid, &o)) < 0) {
 		if (debug)
 			cprintf("openfile_alloc failed: %e", r);
 		return r;
@@ -131,36 +383,47 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %e", r);
-			return r;
+			goto fail;
+		}
+		if (req->req_omode & O_MKDIR) {
+			f->f_type = FTYPE_DIR;
+			flush_block(f);
 		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
 
 	// Truncate
 	if (req->req_omode & O_TRUNC) {
-		if ((r = file_set_size(f, 0)) < 0) {
+		l = file_lock(f, 1);
+		if ((r = file_set_size(f, 0)) >= 0)
+			file_changed(f);
+		file_unlock(l, 1);
+		if (r < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
 	if ((r = file_open(path, &f)) < 0) {
 		if (debug)
 			cprintf("file_open failed: %e", r);
-		return r;
+		goto fail;
 	}
 
 	// Save the file pointer
-	o->o_file = f;
+	openfile_set_file(o, f);
+	o->o_snap = snap > 0 ? snap : 0;
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	o->o_fd->fd_file.size = f->f_size;
+	o->o_fd->fd_file.type = f->f_type;
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
@@ -174,6 +437,10 @@ try_open:
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 
 	return 0;
+
+fail:
+	openfile_free(o);
+	return r;
 }
 
 // Set the size of req->req_fileid to req->req_size bytes, truncating
@@ -182,6 +449,7 @@ int
 serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 {
 	struct OpenFile *o;
+	struct FileLock *l;
 	int r;
 
 	if (debug)
@@ -195,9 +463,38 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	// Second, call the relevant file system function (from fs/fs.c).
+	// Second, call the relevant file system function (from fs/fs.c),
+	// holding the file's lock.
 	// On failure, return the error code to the client.
-	return file_set_size(o->o_file, req->req_size);
+	l = file_lock(o->o_file, 1);
+	if ((r = file_set_size(o->o_file, req->req_size)) >= 0)
+		file_changed(o->o_file);
+	file_unlock(l, 1);
+	return r;
+}
+
+// Give req->req_fileid disk blocks for req->req_len bytes from
+// req->req_offset (see file_allocate).
+int
+serve_fallocate(envid_t envid, struct Fsreq_fallocate *req)
+{
+	struct OpenFile *o;
+	struct FileLock *l;
+	int r;
+
+	if (debug)
+		cprintf("serve_fallocate %08x %08x %08x %08x\n", envid,
+			req->req_fileid, req->req_offset, req->req_len);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	l = file_lock(o->o_file, 1);
+	if ((r = file_allocate(o->o_file, req->req_offset, req->req_len)) >= 0)
+		file_changed(o->o_file);
+	file_unlock(l, 1);
+	return r;
 }
 
 // Read at most ipc->read.req_n bytes from the current seek position
@@ -214,11 +511,15 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 
 	struct OpenFile *o;
+	struct FileLock *l;
 	int r;
 	if ( (r = openfile_lookup(envid, req->req_fileid, &o)) < 0 ){
 		return r;
 	}
-	if ( (r = file_read(o->o_file, ret->ret_buf, req->req_n > PGSIZE ? PGSIZE : req->req_n, o->o_fd->fd_offset)) < 0 ){
+	l = file_lock(o->o_file, 0);
+	r = file_read(o->o_file, ret->ret_buf, req->req_n > PGSIZE ? PGSIZE : req->req_n, o->o_fd->fd_offset);
+	file_unlock(l, 0);
+	if ( r < 0 ){
 		return r;
 	}
 	o->o_fd->fd_offset += r;
@@ -241,6 +542,7 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 
 	int r;
 	struct OpenFile *o;
+	struct FileLock *l;
 	if ( (r = openfile_lookup(envid, req->req_fileid, &o)) < 0 ){
 		return r;
 	}
@@ -248,7 +550,11 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ( n > PGSIZE - (sizeof(int) + sizeof(size_t)) ){
 		n = PGSIZE - (sizeof(int) + sizeof(size_t));
 	}
-	if ( (r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0 ){
+	l = file_lock(o->o_file, 1);
+	if ((r = file_write(o->o_file, req->req_buf, n, o->o_fd->fd_offset)) >= 0)
+		file_changed(o->o_file);
+	file_unlock(l, 1);
+	if ( r < 0 ){
 		return r;
 	}
 	o->o_fd->fd_offset += r;
@@ -258,6 +564,134 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	//panic("serve_write not implemented");
 }
 
+// Return envid's window, or 0 if it has not registered all of it.
+static char *
+client_window(envid_t envid)
+{
+	struct Window *w = &windows[ENVX(envid)];
+
+	if (w->w_owner != envid || w->w_npages != FSWINDOW_PAGES)
+		return 0;
+	return (char *) WINDOWVA + ENVX(envid) * FSWINDOW_SIZE;
+}
+
+// Keep the request page as page ipc->window.req_index of envid's
+// window.  Pages must be registered in order starting from 0; starting
+// again from 0 replaces the window.
+int
+serve_window(envid_t envid, union Fsipc *ipc)
+{
+	struct Window *w = &windows[ENVX(envid)];
+	int i = ipc->window.req_index;
+	char *va;
+	int r;
+
+	if (debug)
+		cprintf("serve_window %08x %d\n", envid, i);
+
+	if (w->w_owner != envid || i == 0) {
+		if (!w->w_owner)
+			winslots[nwinslots++] = ENVX(envid);
+		w->w_owner = envid;
+		w->w_npages = 0;
+	}
+	if (i != w->w_npages || i >= FSWINDOW_PAGES)
+		return -E_INVAL;
+	va = (char *) WINDOWVA + ENVX(envid) * FSWINDOW_SIZE + i * PGSIZE;
+	if ((r = sys_page_map(0, ipc, 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	w->w_npages++;
+	return 0;
+}
+
+// Unmap the windows of envs that have exited, except those with a
+// request still in progress, which may be using theirs.
+static void
+window_reclaim(void)
+{
+	struct Window *w;
+	struct Request *rq;
+	int i, j, slot;
+
+	for (i = 0; i < nwinslots; ) {
+		slot = winslots[i];
+		w = &windows[slot];
+		if (envs[slot].env_id == w->w_owner
+		    && envs[slot].env_status != ENV_FREE) {
+			i++;
+			continue;
+		}
+		for (rq = requests; rq < requests + MAXREQ; rq++)
+			if (rq->rq_whom == w->w_owner)
+				break;
+		if (rq < requests + MAXREQ) {
+			i++;
+			continue;
+		}
+		for (j = 0; j < FSWINDOW_PAGES; j++)
+			sys_page_unmap(0, (char *) WINDOWVA + slot * FSWINDOW_SIZE
+				       + j * PGSIZE);
+		w->w_owner = 0;
+		w->w_npages = 0;
+		winslots[i] = winslots[--nwinslots];
+	}
+}
+
+// Read at most req->req_n bytes from the current seek position of
+// req->req_fileid into the caller's window, and update the seek
+// position.  Returns the number of bytes read, or < 0 on error.
+int
+serve_read_window(envid_t envid, struct Fsreq_winio *req)
+{
+	struct OpenFile *o;
+	struct FileLock *l;
+	char *win;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_window %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if (!(win = client_window(envid)))
+		return -E_INVAL;
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	l = file_lock(o->o_file, 0);
+	r = file_read(o->o_file, win, MIN(req->req_n, FSWINDOW_SIZE), o->o_fd->fd_offset);
+	file_unlock(l, 0);
+	if (r < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Write req->req_n bytes from the caller's window to req->req_fileid at
+// the current seek position, and update the seek position.  Returns the
+// number of bytes written, or < 0 on error.
+int
+serve_write_window(envid_t envid, struct Fsreq_winio *req)
+{
+	struct OpenFile *o;
+	struct FileLock *l;
+	char *win;
+	int r;
+
+	if (debug)
+		cprintf("serve_write_window %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if (!(win = client_window(envid)))
+		return -E_INVAL;
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	l = file_lock(o->o_file, 1);
+	if ((r = file_write(o->o_file, win, MIN(req->req_n, FSWINDOW_SIZE), o->o_fd->fd_offset)) >= 0)
+		file_changed(o->o_file);
+	file_unlock(l, 1);
+	if (r < 0)
+		return r;
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -295,6 +729,54 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	return 0;
 }
 
+// Flush req->req_fileid and, if the caller is its last client, free its
+// open-file entry.  The caller unmaps its Fd page once this returns.
+int
+serve_close(envid_t envid, struct Fsreq_flush *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_close %08x %08x\n", envid, req->req_fileid);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	file_flush(o->o_file);
+	if (pageref(o->o_fd) == 2)
+		openfile_free(o);
+	return 0;
+}
+
+// Remove the file or empty directory req->req_path.  Refuses with
+// -E_BUSY while any client has it open: removal clears its struct File,
+// which the open entries point to.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+	struct File *f;
+	struct FileLock *l;
+	int r;
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	// Wait out reads and writes of the file in progress
+	if ((r = file_open(path, &f)) < 0)
+		return r;
+	l = file_lock(f, 1);
+	if (file_isopen(f))
+		r = -E_BUSY;
+	else
+		r = file_remove(path);
+	file_unlock(l, 1);
+	return r;
+}
 
 int
 serve_sync(envid_t envid, union Fsipc *req)
@@ -303,29 +785,264 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Write back dirty blocks and evict everything from the block cache.
+int
+serve_drop_cache(envid_t envid, union Fsipc *req)
+{
+	if (debug)
+		cprintf("serve_drop_cache %08x\n", envid);
+
+	fs_sync();
+	bc_drop_clean();
+	return 0;
+}
+
+// Return the block-cache page holding byte req->req_offset of
+// req->req_fileid in *pg_store, to be mapped read-only by the caller.
+// The page stays shared with the cache, so the caller sees later writes
+// to the block.  Once the file drops the block the page no longer
+// follows it: whoever allocates the block next gets a fresh zeroed page
+// from bc_zero, never the caller's, so the caller's mapping is detached
+// and must be remapped to see the file again.  For a file stored
+// inline, the page sent is a copy made at stage, the request's own
+// staging page.  Write-only opens cannot map.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, void *stage,
+	  void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	struct File *f;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (req->req_offset < 0 || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+	f = o->o_file;
+	if (file_is_inline(f)) {
+		// Inline data: send a private copy, built in this request's
+		// own page, since reply() may yield to other requests
+		// before sending it.
+		if ((r = sys_page_alloc(0, stage, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		memmove(stage, f->f_inline, FILEINLINE);
+		*pg_store = stage;
+		*perm_store = PTE_P|PTE_U;
+		return 0;
+	}
+	r = file_find_block(f, req->req_offset / BLKSIZE, &blk);
+	if (r == -E_NOT_FOUND) {
+		// A hole: send zeros without allocating a block
+		*pg_store = zeropage;
+		*perm_store = PTE_P|PTE_U;
+		return 0;
+	}
+	if (r < 0)
+		return r;
+
+	// Fault the block in, so there is a page to send
+	*(volatile char *) blk;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return 0;
+}
+
+// Return the file server's statistics in ipc->fsstatRet.
+int
+serve_fsstat(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_fsstat %08x\n", envid);
+
+	memset(&ipc->fsstatRet, 0, sizeof(ipc->fsstatRet));
+	dcache_stat(&ipc->fsstatRet);
+	bc_stat(&ipc->fsstatRet);
+	ide_stat(&ipc->fsstatRet);
+	memmove(ipc->fsstatRet.st_req_count, req_count, sizeof(req_count));
+	memmove(ipc->fsstatRet.st_req_cycles, req_cycles, sizeof(req_cycles));
+	memmove(ipc->fsstatRet.st_req_hist, req_hist, sizeof(req_hist));
+	return 0;
+}
+
+// Create or delete the snapshot req->req_name.  A request that is
+// writing a file may be between finding a block and writing it, so
+// wait until none is; snap_create and snap_delete do not yield.
+int
+serve_snapshot(envid_t envid, struct Fsreq_snapshot *req)
+{
+	char path[MAXNAMELEN + 8];
+	const char *p = path;
+	struct File *root;
+	int i, snap;
+
+	if (debug)
+		cprintf("serve_snapshot %08x %s %d\n", envid, req->req_name,
+			req->req_delete);
+
+	req->req_name[MAXNAMELEN-1] = 0;
+	while (writers_active()) {
+		nblocked++;
+		thread_yield();
+		nblocked--;
+	}
+	if (!req->req_delete)
+		return snap_create(req->req_name);
+
+	snprintf(path, sizeof path, "/.snap/%s", req->req_name);
+	if ((snap = snap_lookup(&p, &root)) <= 0 || *p)
+		return -E_NOT_FOUND;
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_envid && opentab[i].o_snap == snap
+		    && pageref(opentab[i].o_fd) > 1)
+			return -E_BUSY;
+	return snap_delete(req->req_name);
+}
+
+// Return trace events from number ipc->trace.req_pos on in
+// ipc->traceRet.  Returns the number of events.
+int
+serve_trace(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_trace %08x %08x\n", envid, ipc->trace.req_pos);
+
+	return trace_read(ipc->trace.req_pos, &ipc->traceRet);
+}
+
+// Count a request of type 'type' that took 'cycles' to serve.
+static void
+account(uint32_t type, uint64_t cycles)
+{
+	int b;
+
+	if (type >= NFSREQ)
+		type = 0;
+	req_count[type]++;
+	req_cycles[type] += cycles;
+	for (b = 0; b < FSSTAT_NBUCKETS - 1 && cycles >= (1ULL << (FSSTAT_SHIFT + b)); b++)
+		/* find the bucket */;
+	req_hist[type][b]++;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open and map are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_FSSTAT] =	serve_fsstat,
+	[FSREQ_WINDOW] =	serve_window,
+	[FSREQ_READ_WINDOW] =	(fshandler)serve_read_window,
+	[FSREQ_WRITE_WINDOW] =	(fshandler)serve_write_window,
+	[FSREQ_DROP_CACHE] =	serve_drop_cache,
+	[FSREQ_CLOSE] =		(fshandler)serve_close,
+	[FSREQ_FALLOCATE] =	(fshandler)serve_fallocate,
+	[FSREQ_TRACE] =		serve_trace,
+	[FSREQ_SNAPSHOT] =	(fshandler)serve_snapshot
 };
 
-void
-serve(void)
+// Send a reply to client whom.  A client that touched a page we page in
+// for it (see kern/pager.c) cannot receive until that page-in has been
+// answered, so wait for it as a blocked request, letting serve take the
+// page-in request.  A client that has exited gets no reply.
+static void
+reply(envid_t whom, int32_t value, void *pg, int perm)
 {
-	uint32_t req, whom;
+	int r;
+
+	while ((r = sys_ipc_try_send(whom, value, pg ? pg : (void *) UTOP,
+				     perm)) == -E_IPC_NOT_RECV) {
+		if (envs[ENVX(whom)].env_pagein) {
+			nblocked++;
+			thread_yield();
+			nblocked--;
+		} else
+			sys_yield();
+	}
+	if (r < 0 && debug)
+		cprintf("reply to %08x: %e\n", whom, r);
+}
+
+// Serve one request, then exit the thread.
+static void
+serve_thread(uint32_t arg)
+{
+	struct Request *rq = (struct Request *) arg;
 	int perm, r;
 	void *pg;
 
+	perm = 0;
+	pg = NULL;
+	if (rq->rq_type == FSREQ_OPEN) {
+		r = serve_open(rq->rq_whom, (struct Fsreq_open*)rq->rq_ipc, &pg, &perm);
+	} else if (rq->rq_type == FSREQ_MAP || rq->rq_type == FSREQ_PAGEIN) {
+		r = serve_map(rq->rq_whom, (struct Fsreq_map*)rq->rq_ipc,
+			      rq->rq_stage, &pg, &perm);
+	} else if (rq->rq_type < ARRAY_SIZE(handlers) && handlers[rq->rq_type]) {
+		r = handlers[rq->rq_type](rq->rq_whom, rq->rq_ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", rq->rq_type, rq->rq_whom);
+		r = -E_INVAL;
+	}
+	if (rq->rq_type == FSREQ_PAGEIN) {
+		sys_pagein_reply(rq->rq_whom, r, pg ? pg : (void *) UTOP);
+		unblocked = 1;
+	} else
+		reply(rq->rq_whom, r, pg, perm);
+	// The client has its Fd page now, or has exited and left the
+	// entry for openfile_reclaim
+	if (rq->rq_type == FSREQ_OPEN && r >= 0)
+		opentab[((uintptr_t) pg - FILEVA) / PGSIZE].o_pending = 0;
+	// Reading the trace is not traced, or a reader could never catch up
+	if (rq->rq_type != FSREQ_TRACE)
+		trace(FSTRACE_REQ_END, rq->rq_type, rq->rq_whom);
+	account(rq->rq_type, read_tsc() - rq->rq_start);
+	sys_page_unmap(0, rq->rq_ipc);
+	if (pg == rq->rq_stage)
+		sys_page_unmap(0, rq->rq_stage);
+	rq->rq_whom = 0;
+	nrequests--;
+}
+
+// Receive requests and start a thread for each.  Request threads run
+// until they finish or wait, for the disk (see bc_fetch) or for a lock;
+// only then does this thread block receiving the next request, which
+// may be the kernel's signal that the disk is ready.  That signal only
+// wakes this thread, so it lets the others run before it checks, and
+// again while a lock was released or a page-in answered since they
+// last looked.
+static void
+serve(uint32_t arg)
+{
+	uint32_t req, whom;
+	int perm, r;
+	struct Request *rq;
+
 	while (1) {
+		do {
+			unblocked = 0;
+			thread_yield();
+		} while (nrequests > bc_nwaiting + nblocked
+			 || nrequests == MAXREQ || unblocked);
+
+		window_reclaim();
 		perm = 0;
 		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		if (whom == 0)
+			continue;	// disk interrupt; see bc_fetch
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -337,17 +1054,26 @@ serve(void)
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
+		for (rq = requests; rq->rq_whom; rq++)
+			/* a slot is free */;
+		if ((r = sys_page_map(0, fsreq, 0, rq->rq_ipc, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("serve: %e", r);
 		sys_page_unmap(0, fsreq);
+		rq->rq_whom = whom;
+		rq->rq_type = req;
+		rq->rq_start = read_tsc();
+		if (req != FSREQ_TRACE)
+			trace(FSTRACE_REQ_START, req, whom);
+		nrequests++;
+		if ((r = thread_create(0, "serve", serve_thread, (uint32_t) rq)) < 0) {
+			sys_page_unmap(0, rq->rq_ipc);
+			rq->rq_whom = 0;
+			nrequests--;
+			if (req == FSREQ_PAGEIN)
+				sys_pagein_reply(whom, r, (void *) UTOP);
+			else
+				ipc_send(whom, r, 0, 0);
+		}
 	}
 }
 
@@ -364,6 +1090,9 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
-	serve();
+
+	thread_init();
+	thread_create(0, "main", serve, 0);
+	thread_yield();
 }
 
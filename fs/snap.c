@@ -0,0 +1,341 @@
+#include <inc/string.h>
+
+#include "fs.h"
+
+// Snapshots.  A snapshot is a read-only copy of the whole tree, reached
+// as /.snap/NAME/...  Its root directory lives in the superblock.
+// Creating one copies the tree's metadata -- directory blocks and
+// indirect blocks -- into new blocks and shares the data blocks of
+// regular files, so it costs time and space in proportion to the
+// metadata alone.
+//
+// Shared data blocks are frozen: file_get_block copies a frozen block
+// before the live tree writes it, and free_block leaves frozen blocks
+// allocated.  The frozen set lives only in memory; snap_init rebuilds
+// it from the snapshots on disk.
+
+static uint32_t frozen[DISKSIZE / BLKSIZE / 32];
+static uint32_t live[DISKSIZE / BLKSIZE / 32];	// scratch for snap_delete
+
+typedef int (*blockfn)(uint32_t *slot, void *arg);
+
+static void
+mark(uint32_t *set, uint32_t blockno)
+{
+	set[blockno / 32] |= 1U << (blockno % 32);
+}
+
+static bool
+marked(uint32_t *set, uint32_t blockno)
+{
+	return (set[blockno / 32] & (1U << (blockno % 32))) != 0;
+}
+
+bool
+block_is_frozen(uint32_t blockno)
+{
+	return marked(frozen, blockno);
+}
+
+// Call fn on each slot of f that holds a data block number.
+static int
+foreach_block(struct File *f, blockfn fn, void *arg)
+{
+	uint32_t i, j, *ind, *dind;
+	int r;
+
+	for (i = 0; i < NDIRECT; i++)
+		if (f->f_direct[i] && (r = fn(f->f_direct + i, arg)) < 0)
+			return r;
+	if (f->f_indirect) {
+		ind = (uint32_t *) diskaddr(f->f_indirect);
+		for (i = 0; i < NINDIRECT; i++)
+			if (ind[i] && (r = fn(&ind[i], arg)) < 0)
+				return r;
+	}
+	if (f->f_dindirect) {
+		dind = (uint32_t *) diskaddr(f->f_dindirect);
+		for (i = 0; i < NINDIRECT; i++) {
+			if (!dind[i])
+				continue;
+			ind = (uint32_t *) diskaddr(dind[i]);
+			for (j = 0; j < NINDIRECT; j++)
+				if (ind[j] && (r = fn(&ind[j], arg)) < 0)
+					return r;
+		}
+	}
+	return 0;
+}
+
+// Call fn on each slot of f that holds an indirect block number,
+// outermost first: the entries of the double-indirect block are read
+// from whatever block fn left in f_dindirect, so that copy_block
+// rewrites the snapshot's copy rather than the live block.  struct File
+// is packed, so its own slots go through a local.
+static void
+foreach_indirect(struct File *f, blockfn fn, void *arg)
+{
+	uint32_t i, bno, *dind;
+
+	if (f->f_indirect) {
+		bno = f->f_indirect;
+		fn(&bno, arg);
+		if (bno != f->f_indirect)
+			f->f_indirect = bno;
+	}
+	if (f->f_dindirect) {
+		bno = f->f_dindirect;
+		fn(&bno, arg);
+		if (bno != f->f_dindirect)
+			f->f_dindirect = bno;
+		dind = (uint32_t *) diskaddr(bno);
+		for (i = 0; i < NINDIRECT; i++)
+			if (dind[i])
+				fn(&dind[i], arg);
+	}
+}
+
+// Call fn on every file and directory under dir, and on dir itself
+// last, depth first.
+static void
+foreach_file(struct File *dir, void (*fn)(struct File *f, void *arg), void *arg);
+
+static int
+foreach_file_block(uint32_t *slot, void *arg)
+{
+	void **a = arg;
+	struct File *ents = (struct File *) diskaddr(*slot);
+	int i;
+
+	for (i = 0; i < BLKFILES; i++)
+		if (ents[i].f_name[0])
+			foreach_file(&ents[i], a[0], a[1]);
+	return 0;
+}
+
+static void
+foreach_file(struct File *f, void (*fn)(struct File *f, void *arg), void *arg)
+{
+	void *a[2] = { fn, arg };
+
+	if (f->f_type == FTYPE_DIR)
+		foreach_block(f, foreach_file_block, a);
+	fn(f, arg);
+}
+
+// Count in *arg the indirect and directory blocks a snapshot of f needs.
+static int
+count_one(uint32_t *slot, void *arg)
+{
+	++*(uint32_t *) arg;
+	return 0;
+}
+
+static void
+count_meta(struct File *f, void *arg)
+{
+	foreach_indirect(f, count_one, arg);
+	if (f->f_type == FTYPE_DIR)
+		foreach_block(f, count_one, arg);
+}
+
+// Add the data blocks of regular file f to the set arg.
+static int
+mark_one(uint32_t *slot, void *arg)
+{
+	mark(arg, *slot);
+	return 0;
+}
+
+static void
+mark_data(struct File *f, void *arg)
+{
+	if (f->f_type != FTYPE_DIR)
+		foreach_block(f, mark_one, arg);
+}
+
+// Point *slot at a fresh copy of the block it names.  The caller has
+// made sure the disk has room.
+static int
+copy_block(uint32_t *slot, void *arg)
+{
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		panic("copy_block: %e", r);
+	bc_zero(r);
+	memmove(diskaddr(r), diskaddr(*slot), BLKSIZE);
+	*slot = r;
+	return 0;
+}
+
+static int
+flush_one(uint32_t *slot, void *arg)
+{
+	flush_block(diskaddr(*slot));
+	return 0;
+}
+
+// f is a snapshot's copy of a live struct File.  Give it copies of the
+// live file's metadata blocks, recursively for a directory, and freeze
+// the data blocks of a regular file.
+static void snap_copy(struct File *f);
+
+static int
+snap_copy_dirblock(uint32_t *slot, void *arg)
+{
+	struct File *ents;
+	int i;
+
+	copy_block(slot, 0);
+	ents = (struct File *) diskaddr(*slot);
+	for (i = 0; i < BLKFILES; i++)
+		if (ents[i].f_name[0])
+			snap_copy(&ents[i]);
+	flush_block(ents);
+	return 0;
+}
+
+static void
+snap_copy(struct File *f)
+{
+	foreach_indirect(f, copy_block, 0);
+	if (f->f_type == FTYPE_DIR)
+		foreach_block(f, snap_copy_dirblock, 0);
+	else
+		foreach_block(f, mark_one, frozen);
+	foreach_indirect(f, flush_one, 0);
+}
+
+// Find the snapshot called name, or a free slot if name is 0.
+static struct File *
+snap_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < NSNAP; i++)
+		if (name ? strcmp(super->s_snap[i].f_name, name) == 0
+		    : super->s_snap[i].f_name[0] == '\0')
+			return &super->s_snap[i];
+	return 0;
+}
+
+// If *path (past any leading slashes) starts with /.snap/NAME, advance
+// *path past it, set *root to the snapshot's root directory, and return
+// 1 + the snapshot's index.  Return 0 for a path in the live tree and
+// -E_NOT_FOUND for a missing snapshot.
+int
+snap_lookup(const char **path, struct File **root)
+{
+	const char *p = *path;
+	char name[MAXNAMELEN];
+	int n;
+
+	while (*p == '/')
+		p++;
+	if (strncmp(p, ".snap", 5) != 0 || (p[5] != '/' && p[5] != '\0'))
+		return 0;
+	for (p += 5; *p == '/'; p++)
+		/* skip */;
+	for (n = 0; p[n] && p[n] != '/'; n++)
+		/* find the end of the name */;
+	if (n == 0 || n >= MAXNAMELEN)
+		return -E_NOT_FOUND;
+	memmove(name, p, n);
+	name[n] = '\0';
+	if (!(*root = snap_find(name)))
+		return -E_NOT_FOUND;
+	*path = p + n;
+	return *root - super->s_snap + 1;
+}
+
+// Create a snapshot called name of the live tree.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_PATH if name is empty, too long or contains '/'.
+//	-E_FILE_EXISTS if there is already a snapshot called name.
+//	-E_MAX_OPEN if there are already NSNAP snapshots.
+//	-E_NO_DISK if there is no room for the copied metadata.
+int
+snap_create(const char *name)
+{
+	struct File *s;
+	uint32_t nmeta = 0;
+
+	if (!name[0] || strlen(name) >= MAXNAMELEN || strchr(name, '/'))
+		return -E_BAD_PATH;
+	if (snap_find(name))
+		return -E_FILE_EXISTS;
+	if (!(s = snap_find(0)))
+		return -E_MAX_OPEN;
+
+	// Make sure the copy cannot run out of space halfway
+	foreach_file(&super->s_root, count_meta, &nmeta);
+	if (nmeta > free_block_count())
+		return -E_NO_DISK;
+
+	*s = super->s_root;
+	strcpy(s->f_name, name);
+	snap_copy(s);
+	flush_block(super);
+	return 0;
+}
+
+// Free the blocks of snapshot file f, except the data blocks that the
+// live tree uses (marked in 'live') or another snapshot does (frozen,
+// which free_block skips).  Directory and indirect blocks are the
+// snapshot's own.
+static int
+free_one(uint32_t *slot, void *arg)
+{
+	if (!marked(live, *slot))
+		free_block(*slot);
+	return 0;
+}
+
+static void
+snap_free(struct File *f, void *arg)
+{
+	if (f->f_type == FTYPE_DIR)
+		dcache_invalidate_dir(f);
+	foreach_block(f, free_one, 0);
+	foreach_indirect(f, free_one, 0);
+}
+
+// Delete the snapshot called name.
+// Returns 0 on success, -E_NOT_FOUND if there is no such snapshot.
+int
+snap_delete(const char *name)
+{
+	struct File *s;
+	uint32_t i;
+
+	if (!name[0] || !(s = snap_find(name)))
+		return -E_NOT_FOUND;
+
+	// Unfreeze the blocks only s uses, and note which blocks the live
+	// tree still uses.
+	memset(frozen, 0, sizeof(frozen));
+	for (i = 0; i < NSNAP; i++)
+		if (super->s_snap[i].f_name[0] && &super->s_snap[i] != s)
+			foreach_file(&super->s_snap[i], mark_data, frozen);
+	memset(live, 0, sizeof(live));
+	foreach_file(&super->s_root, mark_data, live);
+
+	foreach_file(s, snap_free, 0);
+	memset(s, 0, sizeof(*s));
+	flush_block(super);
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		flush_block(diskaddr(2 + i));
+	return 0;
+}
+
+// Rebuild the frozen set from the snapshots on disk.
+void
+snap_init(void)
+{
+	int i;
+
+	for (i = 0; i < NSNAP; i++)
+		if (super->s_snap[i].f_name[0])
+			foreach_file(&super->s_snap[i], mark_data, frozen);
+}
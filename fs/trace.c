@@ -0,0 +1,40 @@
+#include <inc/x86.h>
+
+#include "fs.h"
+
+// Binary trace of file server events.  Events are numbered from 0 as
+// they happen, and the ring keeps the last NTRACE of them.  Logging one
+// costs a read_tsc and four stores, so it is always on.
+
+#define NTRACE		4096
+
+static struct Fstrace ring[NTRACE];
+static uint32_t nevents;	// number of the next event
+
+void
+trace(uint16_t event, uint16_t type, uint32_t arg)
+{
+	struct Fstrace *t = &ring[nevents++ % NTRACE];
+
+	t->tr_tsc = read_tsc();
+	t->tr_event = event;
+	t->tr_type = type;
+	t->tr_arg = arg;
+}
+
+// Copy events from number pos on into ret, as many as fit.  Returns the
+// number copied.
+int
+trace_read(uint32_t pos, struct Fsret_trace *ret)
+{
+	int n;
+
+	if (pos > nevents)
+		pos = nevents;
+	if (nevents > NTRACE && pos < nevents - NTRACE)
+		pos = nevents - NTRACE;
+	ret->ret_pos = pos;
+	for (n = 0; pos + n < nevents && n < ARRAY_SIZE(ret->ret_ents); n++)
+		ret->ret_ents[n] = ring[(pos + n) % NTRACE];
+	return n;
+}
@@ -38,6 +38,13 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Values of env_pagein (see kern/pager.c)
+enum {
+	PAGEIN_NONE = 0,
+	PAGEIN_QUEUED,		// Request waiting for the pager's ipc_recv
+	PAGEIN_SENT,		// Request delivered, reply not yet in
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -67,6 +74,15 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_irq_pending;	// IRQs to deliver on the next ipc_recv
+
+	// Demand paging (see kern/pager.c)
+	envid_t env_pager;		// File server that pages in PTE_FILE pages
+	int env_pager_fileid;		// Open file they come from
+	void *env_pager_req;		// Our page for the requests
+	int env_pagein;			// PAGEIN_ state; blocked unless NONE
+	void *env_pagein_va;		// Page we wait for
+	uint32_t env_npagein;		// Page-ins queued for us, as a pager
 };
 
 #endif // !JOS_INC_ENV_H
@@ -30,6 +30,11 @@ enum {
 	E_FULL_BUF	,
 	E_NO_RECV	,
 
+	// Later file system error codes, added here so that the codes
+	// above keep their values
+	E_NOT_EMPTY	,	// Directory is not empty
+	E_BUSY		,	// Resource is in use
+
 	MAXERROR
 };
 
@@ -25,6 +25,11 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	// Kept current by the file server so that clients can cache file
+	// data without asking (see lib/file.c)
+	off_t size;		// file size
+	uint32_t gen;		// bumped whenever the data or size change
+	int type;		// FTYPE_REG or FTYPE_DIR
 };
 
 struct FdSock {
@@ -23,8 +23,20 @@
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
+// Number of blocks reachable through the double-indirect block
+#define NDINDIRECT	(NINDIRECT * NINDIRECT)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Number of blocks a file's block map can describe
+#define MAXFILEBLOCKS	(NDIRECT + NINDIRECT + NDINDIRECT)
+// The block map reaches 4GB, but file offsets are signed 32-bit
+#define MAXFILESIZE	0x7FFFF000
+
+// Bytes of data a struct File can hold inline (what pads it out to 256
+// bytes; must do arithmetic in case we're compiling fsformat on a
+// 64-bit machine).  A regular file that small and without a first
+// block keeps its data in f_inline instead of in blocks.  The bytes of
+// f_inline past the end of the data are always zero.
+#define FILEINLINE	(256 - MAXNAMELEN - 8 - 4*NDIRECT - 8)
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
@@ -35,10 +47,10 @@ struct File {
 	// A block is allocated iff its value is != 0.
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
+	uint32_t f_dindirect;		// double-indirect block
 
-	// Pad out to 256 bytes; must do arithmetic in case we're compiling
-	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	// Data of small files; pads out to 256 bytes
+	uint8_t f_inline[FILEINLINE];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,15 +60,42 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// A directory is a hash table of struct File slots made of levels: level
+// k is 2^k blocks long and starts at directory block 2^k - 1, so a
+// directory with L levels is 2^L - 1 blocks.  An entry lives in block
+// dir_hash(name) mod 2^k of some level k; when those blocks are full in
+// every level the directory grows by one level.  Entries never move, so
+// a struct File stays put for as long as it exists.
+static inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;	// 32-bit FNV-1a
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
 #define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
 
+// On-disk format revision, bumped whenever struct File or struct Super
+// changes shape.  Version 2 added the double-indirect block, version 3
+// hashed directories, version 4 snapshots, version 5 inline data.
+#define FS_VERSION	5
+
+// Max number of snapshots (see fs/snap.c)
+#define NSNAP		8
+
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
+	uint32_t s_version;		// On-disk format: FS_VERSION
 	struct File s_root;		// Root directory node
+	struct File s_snap[NSNAP];	// Snapshot roots, named by f_name;
+					// unused if f_name is empty
 };
 
 // Definitions for requests from clients to file system
@@ -70,7 +109,75 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Fsstat returns a struct Fsstat on the request page
+	FSREQ_FSSTAT,
+	// Map returns a read-only block-cache page instead of the request page
+	FSREQ_MAP,
+	// Window registers the request page as part of the client's window
+	FSREQ_WINDOW,
+	// These move their data through the client's window
+	FSREQ_READ_WINDOW,
+	FSREQ_WRITE_WINDOW,
+	FSREQ_DROP_CACHE,
+	// Close is a flush that also lets the server forget the open file
+	FSREQ_CLOSE,
+	FSREQ_FALLOCATE,
+	// Trace returns a Fsret_trace on the request page
+	FSREQ_TRACE,
+	FSREQ_SNAPSHOT,
+	// Pagein is a map the kernel sends for a client that touched a
+	// PTE_FILE page; it is answered with sys_pagein_reply
+	FSREQ_PAGEIN,
+	NFSREQ
+};
+
+// Bulk transfer window.  A client registers FSWINDOW_PAGES pages of its
+// own memory with the server once; after that a read or write of up to
+// FSWINDOW_SIZE bytes moves through them in a single request.
+#define FSWINDOW_PAGES	16
+#define FSWINDOW_SIZE	(FSWINDOW_PAGES * PGSIZE)
+
+// Request latency histogram buckets.  Bucket 0 counts requests that
+// took under 2^FSSTAT_SHIFT cycles, and each later bucket twice as long;
+// the last also counts everything slower.
+#define FSSTAT_NBUCKETS	16
+#define FSSTAT_SHIFT	12
+
+// File server statistics
+struct Fsstat {
+	// Path lookup cache
+	uint32_t st_dcache_hits;	// lookups answered with an entry
+	uint32_t st_dcache_neg_hits;	// lookups answered "no such entry"
+	uint32_t st_dcache_misses;	// lookups that searched the directory
+	// Block cache
+	uint32_t st_bc_hits;		// data blocks found in memory
+	uint32_t st_bc_misses;		// blocks read from disk
+	uint32_t st_bc_flushes;		// blocks written to disk
+	// Disk
+	uint32_t st_ide_sectors_read;
+	uint32_t st_ide_sectors_written;
+	uint64_t st_ide_wait_cycles;	// spent polling for the drive
+	// Requests, by FSREQ_ code, timed from receipt to reply
+	uint32_t st_req_count[NFSREQ];
+	uint64_t st_req_cycles[NFSREQ];
+	uint32_t st_req_hist[NFSREQ][FSSTAT_NBUCKETS];
+};
+
+// The file server logs events to a ring of these, which clients read
+// with FSREQ_TRACE.
+struct Fstrace {
+	uint64_t tr_tsc;	// when it happened
+	uint16_t tr_event;	// FSTRACE_ code
+	uint16_t tr_type;	// FSREQ_ code for request events
+	uint32_t tr_arg;	// client envid, or block number
+};
+
+enum {
+	FSTRACE_REQ_START = 1,	// request received
+	FSTRACE_REQ_END,	// reply sent
+	FSTRACE_READ,		// disk read started
+	FSTRACE_WRITE,		// block written back
 };
 
 union Fsipc {
@@ -108,6 +215,35 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsstat fsstatRet;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+	} map;
+	struct Fsreq_window {
+		int req_index;		// which page of the window this is
+	} window;
+	struct Fsreq_winio {
+		int req_fileid;
+		size_t req_n;		// at most FSWINDOW_SIZE
+	} winio;
+	struct Fsreq_trace {
+		uint32_t req_pos;	// first event wanted
+	} trace;
+	struct Fsret_trace {
+		uint32_t ret_pos;	// number of ret_ents[0]; later than
+					// req_pos if older events were lost
+		struct Fstrace ret_ents[(PGSIZE - 8) / sizeof(struct Fstrace)];
+	} traceRet;
+	struct Fsreq_snapshot {
+		char req_name[MAXNAMELEN];
+		int req_delete;		// delete rather than create
+	} snapshot;
+	struct Fsreq_fallocate {
+		int req_fileid;
+		off_t req_offset;
+		off_t req_len;
+	} fallocate;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
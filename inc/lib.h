@@ -39,6 +39,7 @@ void	exit(void);
 
 // pgfault.c
 void	set_pgfault_handler(void (*handler)(struct UTrapframe *utf));
+void	add_pgfault_hook(int (*hook)(struct UTrapframe *utf));
 
 // readline.c
 char*	readline(const char *buf);
@@ -50,16 +51,21 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+static envid_t sys_fork_cow(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_pager(envid_t env, envid_t pager, int fileid, void *reqva);
+int	sys_pagein_reply(envid_t env, int32_t value, void *srcva);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_map_range(const struct PageMap *maps, int n);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
 unsigned int sys_time_msec(void);
+int	sys_irq_listen(int irq);
 int	sys_ether_try_send(void* buf_to_send, size_t sz);
 int	sys_ether_try_recv(void* buf_to_recv, size_t sz);
 
@@ -74,13 +80,25 @@ sys_exofork(void)
 	return ret;
 }
 
+// Like sys_exofork, and inlined for the same reason, but the child gets
+// a copy-on-write copy of our address space and starts out runnable.
+static inline envid_t __attribute__((always_inline))
+sys_fork_cow(void)
+{
+	envid_t ret;
+	asm volatile("int %2"
+		     : "=a" (ret)
+		     : "a" (SYS_fork_cow), "i" (T_SYSCALL)
+		     : "memory");
+	return ret;
+}
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -105,6 +123,15 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fsstat(struct Fsstat *st);
+int	fsdropcache(void);
+int	fstrace(uint32_t *pos, struct Fstrace *ents, int n);
+int	snapshot(const char *name);
+int	snapshot_delete(const char *name);
+int	fallocate(int fdnum, off_t offset, off_t len);
+int	read_map(int fdnum, off_t offset, void *dstva);
+int	mmap(void *va, size_t len, int prot, int fdnum, off_t offset);
+int	munmap(void *va, size_t len);
 
 // pageref.c
 int	pageref(void *addr);
@@ -156,4 +183,8 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections */
+#define	PROT_READ	0x1		/* pages may be read */
+#define	PROT_WRITE	0x2		/* pages may be written (privately) */
+
 #endif	// !JOS_INC_LIB_H
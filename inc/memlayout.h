@@ -43,14 +43,16 @@
  *                     +------------------------------+                   |
  *                     :              .               :                   |
  *                     :              .               :                   |
- *    MMIOLIM ------>  +------------------------------+ 0xefc00000      --+
+ *                     +------------------------------+ 0xefc10000        |
+ *                     |     Per-CPU kmap windows     | RW/--  KMAPSIZE   |
+ * MMIOLIM,KMAPBASE -> +------------------------------+ 0xefc00000      --+
  *                     |       Memory-mapped I/O      | RW/--  PTSIZE
  * ULIM, MMIOBASE -->  +------------------------------+ 0xef800000
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
- *                     |          RO PAGES            | R-/R-  PTSIZE
- *    UPAGES    ---->  +------------------------------+ 0xef000000
- *                     |           RO ENVS            | R-/R-  PTSIZE
+ *                     |          RO PAGES            | R-/R-  UPAGES_SIZE
+ *    UPAGES    ---->  +------------------------------+ 0xeed00000
+ *                     |           RO ENVS            | R-/R-  UENVS_SIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebff000
@@ -101,6 +103,11 @@
 #define MMIOLIM		(KSTACKTOP - PTSIZE)
 #define MMIOBASE	(MMIOLIM - PTSIZE)
 
+// Windows through which the kernel reaches physical pages that are not
+// in the mapping at KERNBASE (see kmap), below the kernel stacks.
+#define KMAPBASE	MMIOLIM
+#define KMAPSIZE	(16*PGSIZE)
+
 #define ULIM		(MMIOBASE)
 
 /*
@@ -110,10 +117,14 @@
 
 // User read-only virtual page table (see 'uvpt' below)
 #define UVPT		(ULIM - PTSIZE)
-// Read-only copies of the Page structures
-#define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
-#define UENVS		(UPAGES - PTSIZE)
+#define UENVS		(UVPT - 2*PTSIZE)
+#define UENVS_SIZE	(PTSIZE / 4)
+// Read-only copies of the Page structures, which get the rest of the
+// space below UVPT: there is one per page of physical memory, so this
+// bounds how much of it the kernel can use
+#define UPAGES		(UENVS + UENVS_SIZE)
+#define UPAGES_SIZE	(UVPT - UPAGES)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -178,6 +189,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// The pointer to this page on the free list, for unlinking it.
+	struct PageInfo **pp_pprev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,6 +198,11 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Set if this page starts a free block of 2^pp_order pages in
+	// the buddy allocator.
+	uint8_t pp_free;
+	uint8_t pp_order;
 };
 
 #endif /* !__ASSEMBLER__ */
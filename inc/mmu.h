@@ -69,6 +69,20 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Software bits the user library and the kernel agree on.  PTE_SHARE
+// pages are shared, not copied, by fork and spawn; PTE_COW marks
+// copy-on-write entries.
+#define PTE_SHARE	0x400
+#define PTE_COW		0x800
+
+// With PTE_P clear the hardware ignores the other bits, and the kernel
+// uses them for pages it fills in on first touch (see kern/pager.c).
+// PTE_ZFOD pages start out zeroed.  PTE_FILE pages come from the
+// environment's pager; PTE_ADDR holds their offset in the file.  PTE_W
+// and PTE_U give the permissions the page will have.
+#define PTE_ZFOD	0x200
+#define PTE_FILE	0x400
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -89,6 +103,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -96,6 +111,10 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID function 1 feature flags (in %edx)
+#define CPUID_PSE	0x00000008	// Page Size Extensions
+#define CPUID_PGE	0x00002000	// Page Global Enable
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
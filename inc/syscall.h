@@ -1,6 +1,8 @@
 #ifndef JOS_INC_SYSCALL_H
 #define JOS_INC_SYSCALL_H
 
+#include <inc/env.h>
+
 /* system call numbers */
 enum {
 	SYS_cputs = 0,
@@ -20,7 +22,33 @@ enum {
 	SYS_time_msec,
 	SYS_ether_try_send,
 	SYS_ether_try_recv,
+	SYS_irq_listen,
+	SYS_fork_cow,
+	SYS_page_map_range,
+	SYS_env_set_pager,
+	SYS_pagein_reply,
 	NSYSCALLS
 };
 
+// One request to sys_page_map_range: apply op to pm_npages consecutive
+// pages starting at pm_srcva in pm_srcenv and pm_dstva in pm_dstenv.
+struct PageMap {
+	int pm_op;		// PM_ALLOC, PM_MAP or PM_UNMAP
+	envid_t pm_srcenv;	// PM_MAP only
+	uintptr_t pm_srcva;	// PM_MAP only
+	envid_t pm_dstenv;
+	uintptr_t pm_dstva;
+	int pm_perm;		// PM_ALLOC and PM_MAP
+	int pm_npages;
+};
+
+enum {
+	PM_ALLOC = 0,		// like sys_page_alloc(dstenv, dstva, perm)
+	PM_MAP,			// like sys_page_map(srcenv, srcva, dstenv, dstva, perm)
+	PM_UNMAP,		// like sys_page_unmap(dstenv, dstva)
+	PM_ZERO,		// replace with zero pages filled in on first touch
+	PM_FILE,		// replace with pages of dstenv's pager file, paged
+				// in on first touch; pm_srcva is the file offset
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
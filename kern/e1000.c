@@ -19,7 +19,8 @@ static volatile struct Rdesc rdescs[RECV_NRDESC];
 
 // one pages holds 2 buffer
 // the buffer size for e1000 to use is 1518, however, this buffer must be contiguous
-// thus we allocate for every buffer 2000 byte, one page 2 such buffer
+// thus we allocate for every buffer 2000 byte, one page 2 such buffer.
+// All the buffers of a ring come from one physically contiguous run.
 #define	TNBUF_PERPG	2 //(PGSIZE/TRANS_BUFSZ)
 #define TBUF_ALLOC	(PGSIZE/2)
 #define	RNBUF_PERPG	2 //(PGSIZE/RECV_BUFSZ)
@@ -28,15 +29,12 @@ static volatile struct Rdesc rdescs[RECV_NRDESC];
 static void init_trans(){
 	// allocate space for transbuf
 	assert(TRANS_NTDESC % TNBUF_PERPG == 0); // number of buffer is even
-	for ( int i = 0; i < TRANS_NTDESC / TNBUF_PERPG; i++ ){
-		struct PageInfo *p = page_alloc(0);
-		p->pp_ref++;		
-		if (!p){
-			panic("init_trans: %e\n", E_NO_MEM);
-		}
-		for ( int j = 0; j < TNBUF_PERPG; j++ ){
-			tdescs[i * TNBUF_PERPG + j].tdesc_buf = (uint32_t)page2pa(p) + j * TBUF_ALLOC;
-		}
+	struct PageInfo *p = page_alloc_npages(TRANS_NTDESC / TNBUF_PERPG, 0);
+	if (!p){
+		panic("init_trans: %e\n", E_NO_MEM);
+	}
+	for ( int i = 0; i < TRANS_NTDESC; i++ ){
+		tdescs[i].tdesc_buf = (uint32_t)page2pa(p) + i * TBUF_ALLOC;
 	}
 
 	// set lagecy mode already done( because it's 0 )
@@ -73,15 +71,12 @@ static void init_trans(){
 static void init_recv(){
 	// init receive buffers
 	assert(RECV_NRDESC % RNBUF_PERPG == 0); // number of buffer is even
-	for ( int i = 0; i < RECV_NRDESC / RNBUF_PERPG; i++ ){
-		struct PageInfo *p = page_alloc(0);
-		p->pp_ref++;		
-		if (!p){
-			panic("init_recv: %e\n", E_NO_MEM);
-		}
-		for ( int j = 0; j < RNBUF_PERPG; j++ ){
-			rdescs[i * RNBUF_PERPG + j].rdesc_buf = (uint32_t)page2pa(p) + j * RBUF_ALLOC;
-		}
+	struct PageInfo *p = page_alloc_npages(RECV_NRDESC / RNBUF_PERPG, 0);
+	if (!p){
+		panic("init_recv: %e\n", E_NO_MEM);
+	}
+	for ( int i = 0; i < RECV_NRDESC; i++ ){
+		rdescs[i].rdesc_buf = (uint32_t)page2pa(p) + i * RBUF_ALLOC;
 	}
 	
 	// set RAL[0] and RAH[0]
@@ -116,7 +111,10 @@ int e1000_transmit(void *buf_to_trans, size_t sz){
 	if ( !(tdescs[ind].tdesc_status & TDESC_STAT_DD) ){
 		return -E_FULL_BUF;
 	}
-	memcpy((void*)KADDR(tdescs[ind].tdesc_buf), buf_to_trans, sz);
+	// buf_to_trans is a user address
+	if ( copyin((void*)KADDR(tdescs[ind].tdesc_buf), buf_to_trans, sz) < 0 ){
+		return -E_FAULT;
+	}
 	tdescs[ind].tdesc_length = sz;
 	tdescs[ind].tdesc_status &= ~TDESC_STAT_DD;
 	*(uint32_t*)(e1000_addr + ETHER_TDT) = (ind + 1) % TRANS_NTDESC;
@@ -133,7 +131,10 @@ int e1000_receive(void *buf_to_recv, size_t sz){
 	}
 	// the actual size is the minimum of sz and rdesc_length
 	size_t acsz = MIN(sz, rdescs[ind].rdesc_length);
-	memcpy(buf_to_recv, (void*)KADDR(rdescs[ind].rdesc_buf), acsz);
+	// buf_to_recv is a user address
+	if ( copyout(buf_to_recv, (void*)KADDR(rdescs[ind].rdesc_buf), acsz) < 0 ){
+		return -E_FAULT;
+	}
 	rdescs[ind].rdesc_status &= ~RDESC_STATUS_DD;
 	*(uint32_t*)(e1000_addr + ETHER_RDT) = ind;
 	return acsz;
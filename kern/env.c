@@ -186,13 +186,11 @@ env_setup_vm(struct Env *e)
 	//    - The functions in kern/pmap.h are handy.
 	p->pp_ref++;
 	e->env_pgdir = page2kva(p);
-	e->env_pgdir[PDX(UENVS)] = kern_pgdir[PDX(UENVS)];
-	e->env_pgdir[PDX(UPAGES)] = kern_pgdir[PDX(UPAGES)];
-	e->env_pgdir[PDX(KSTACKTOP-PGSIZE)] = kern_pgdir[PDX(KSTACKTOP-PGSIZE)];
-	e->env_pgdir[PDX(MMIOBASE)] = kern_pgdir[PDX(MMIOBASE)];
-	for ( int i = 0; i < ~KERNBASE+1; i += PGSIZE ){
-		e->env_pgdir[PDX(KERNBASE+i)] = kern_pgdir[PDX(KERNBASE+i)];
-	}
+	// Everything above UTOP comes from kern_pgdir in one copy; the
+	// page directory is fresh from page_alloc(ALLOC_ZERO), so the
+	// user part is already empty.
+	memcpy(&e->env_pgdir[PDX(UTOP)], &kern_pgdir[PDX(UTOP)],
+	       (NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
 
 	// LAB 3: Your code here.
 
@@ -267,6 +265,10 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_irq_pending = 0;
+	e->env_pager = 0;
+	e->env_pagein = PAGEIN_NONE;
+	e->env_npagein = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -290,7 +292,7 @@ region_alloc(struct Env *e, void *va, size_t len)
 	uint8_t *vstart = (uint8_t*)ROUNDDOWN(va, PGSIZE);
 	uint8_t *vend = (uint8_t*)ROUNDUP(va + len, PGSIZE);
 	for ( uint8_t *walker = vstart; walker < vend; walker += PGSIZE ){
-		struct PageInfo *p = page_alloc(0);
+		struct PageInfo *p = page_alloc(ALLOC_HIGH);
 		if ( !p ){
 			panic("region_alloc: %e\n", E_NO_MEM);
 		}
@@ -441,11 +443,13 @@ env_free(struct Env *e)
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
+		// unmap all PTEs in this page table, unless other
+		// environments still share it (see pgdir_copy_cow)
+		if (pa2page(pa)->pp_ref == 1)
+			for (pteno = 0; pteno <= PTX(~0); pteno++) {
+				if (pt[pteno] & PTE_P)
+					page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+			}
 
 		// free the page table itself
 		e->env_pgdir[pdeno] = 0;
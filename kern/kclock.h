@@ -23,6 +23,9 @@
 #define NVRAM_EXT16LO	(MC_NVRAM_START + 38)	/* low byte; RTC off. 0x34 */
 #define NVRAM_EXT16HI	(MC_NVRAM_START + 39)	/* high byte; RTC off. 0x35 */
 
+/* NVRAM bytes 77 to 79: memory size above 4G, in 64K units (QEMU, Bochs) */
+#define NVRAM_HIGHMEM	(MC_NVRAM_START + 77)	/* low byte; RTC off. 0x5b */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 
@@ -0,0 +1,198 @@
+// Demand paging.
+//
+// A page table entry below UTOP with PTE_P clear may still describe a
+// page that the kernel fills in on first touch (see inc/mmu.h).
+// PTE_ZFOD pages are allocated zeroed right away.  PTE_FILE pages come
+// from the environment's pager, a file server: the kernel writes an
+// FSREQ_PAGEIN request for the page into env_pager_req, sends it to the
+// pager on the environment's behalf, and blocks the environment until
+// the pager answers with sys_pagein_reply, which maps the page.  The
+// faulting instruction, or the system call that touched the page, then
+// runs again.
+//
+// Page-ins have a channel of their own.  The environment may have an
+// ordinary request out to the same server, whose reply must wait until
+// the environment runs again and receives it; sys_ipc_try_send sees an
+// environment blocked here as not receiving.  And a request to a pager
+// that is not receiving, perhaps because it is trying to send that very
+// reply, is queued, and delivered by the pager's next sys_ipc_recv.
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/fs.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/pager.h>
+#include <kern/sched.h>
+#include <kern/syscall.h>
+
+//
+// If a page-in request is queued for pager, which must be receiving,
+// deliver it.  Returns 1 if one was delivered, 0 if not.
+//
+int
+pagein_deliver(struct Env *pager)
+{
+	struct PageInfo *req;
+	struct Env *e;
+	int i;
+
+	if (!pager->env_npagein)
+		return 0;
+	for (i = 0; i < NENV; i++) {
+		e = &envs[i];
+		if (e->env_status != ENV_NOT_RUNNABLE
+		    || e->env_pagein != PAGEIN_QUEUED
+		    || e->env_pager != pager->env_id)
+			continue;
+		if (!(req = page_lookup(e->env_pgdir, e->env_pager_req, NULL))) {
+			cprintf("[%08x] no page-in request page\n", e->env_id);
+			env_destroy(e);
+			continue;
+		}
+		if (ipc_deliver(pager, e->env_id, FSREQ_PAGEIN, req,
+				PTE_P|PTE_U|PTE_W) < 0)
+			return 0;
+		e->env_pagein = PAGEIN_SENT;
+		pager->env_npagein--;
+		return 1;
+	}
+	// The rest went away before being asked for
+	pager->env_npagein = 0;
+	return 0;
+}
+
+// Ask e's pager for the PTE_FILE page at va.  Does not return.
+static void
+pagein(struct Env *e, void *va, pte_t pte)
+{
+	struct Env *pager;
+	struct PageInfo *req;
+	struct Fsreq_map *map;
+	pte_t *reqpte;
+
+	// Whether or not the request goes out now, e runs the faulting
+	// instruction again when it next runs; for a system call, that
+	// is the int.  A
+	// sys_page_map_range batch in progress is cut short here.
+	if (e->env_tf.tf_trapno == T_SYSCALL)
+		e->env_tf.tf_eip -= 2;
+	tlb_batch_end();
+
+	if (envid2env(e->env_pager, &pager, 0) < 0
+	    || !(req = page_lookup(e->env_pgdir, e->env_pager_req, &reqpte))) {
+		cprintf("[%08x] no pager for va %08x\n", e->env_id, va);
+		env_destroy(e);
+	}
+	if ((*reqpte & PTE_COW) && page_cow_fault(e->env_pgdir, e->env_pager_req) < 0)
+		sched_yield();
+	req = page_lookup(e->env_pgdir, e->env_pager_req, NULL);
+
+	map = (struct Fsreq_map *) kmap(req, 0);
+	map->req_fileid = e->env_pager_fileid;
+	map->req_offset = PTE_ADDR(pte);
+	e->env_pagein_va = va;
+	e->env_pagein = PAGEIN_QUEUED;
+	e->env_status = ENV_NOT_RUNNABLE;
+	pager->env_npagein++;
+	if (pager->env_ipc_recving)
+		pagein_deliver(pager);
+	sched_yield();
+}
+
+//
+// Make the page at va in e's address space present and, if perm has
+// PTE_W, writable: fill in a PTE_ZFOD page, resolve a PTE_COW one, or
+// -- if wait is set and e is curenv -- page in a PTE_FILE page, which
+// does not return.
+//
+// RETURNS:
+//   0 if the page was made accessible
+//   -E_FAULT, if there is nothing to do at va
+//   -E_NO_MEM, if there is no memory for the page
+//
+int
+page_demand(struct Env *e, void *va, int perm, bool wait)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || !(pte = pgdir_walk(e->env_pgdir, va, 0)))
+		return -E_FAULT;
+	if (*pte & PTE_P) {
+		if ((perm & PTE_W) && (*pte & PTE_COW))
+			return page_cow_fault(e->env_pgdir, va);
+		return -E_FAULT;
+	}
+	if (*pte & PTE_ZFOD) {
+		perm = *pte & (PTE_W|PTE_U);
+		if (!(pp = page_alloc(ALLOC_ZERO|ALLOC_HIGH)))
+			return -E_NO_MEM;
+		if ((r = page_insert(e->env_pgdir, pp, va, perm)) < 0) {
+			page_free(pp);
+			return r;
+		}
+		return 0;
+	}
+	if ((*pte & PTE_FILE) && wait && e == curenv)
+		pagein(e, va, *pte);
+	return -E_FAULT;
+}
+
+//
+// Replace whatever is mapped at va in pgdir with the lazy entry 'lazy':
+// PTE_ZFOD or PTE_FILE, plus PTE_W and PTE_U, plus the file offset for
+// PTE_FILE.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//
+int
+page_set_lazy(pde_t *pgdir, void *va, pte_t lazy)
+{
+	pte_t *pte;
+
+	assert(!(lazy & PTE_P));
+	page_remove(pgdir, va);
+	if (!(pte = pgdir_walk(pgdir, va, 1)))
+		return -E_NO_MEM;
+	*pte = lazy;
+	return 0;
+}
+
+//
+// The pager answered e's request with value and page pp (0 if none).
+// Map the page where e wanted it -- copy-on-write if it is to be
+// writable, since the page belongs to the pager's cache -- and let e
+// run again.
+//
+void
+pagein_finish(struct Env *e, int32_t value, struct PageInfo *pp)
+{
+	void *va = e->env_pagein_va;
+	pte_t *pte = pgdir_walk(e->env_pgdir, va, 0);
+	int perm;
+
+	e->env_pagein = PAGEIN_NONE;
+	e->env_status = ENV_RUNNABLE;
+	// Someone may have mapped something else there in the meantime
+	if (!pte || (*pte & PTE_P) || !(*pte & PTE_FILE))
+		return;
+	if (value < 0 || !pp) {
+		cprintf("[%08x] page-in of va %08x failed: %e\n",
+			e->env_id, va, value < 0 ? value : -E_INVAL);
+		env_destroy(e);
+		return;
+	}
+	perm = *pte & PTE_U;
+	if (*pte & PTE_W)
+		perm |= PTE_COW;
+	if (page_insert(e->env_pgdir, pp, va, perm) < 0)
+		// Leave the entry lazy; e faults and asks again.
+		return;
+}
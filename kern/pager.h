@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_PAGER_H
+#define JOS_KERN_PAGER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int	page_demand(struct Env *e, void *va, int perm, bool wait);
+int	page_set_lazy(pde_t *pgdir, void *va, pte_t lazy);
+int	pagein_deliver(struct Env *pager);
+void	pagein_finish(struct Env *e, int32_t value, struct PageInfo *pp);
+
+#endif /* !JOS_KERN_PAGER_H */
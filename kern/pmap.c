@@ -10,6 +10,8 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/pager.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -18,7 +20,54 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Free physical pages live in a buddy allocator: a free block of
+// 2^order pages, aligned to its size, sits on free_area[order], and
+// freeing a block merges it with its buddy whenever that is free too.
+// In front of it each CPU keeps a magazine of single free pages, so
+// page_alloc and page_free normally touch only per-CPU state; they
+// refill and drain magazines MAGBATCH pages at a time under page_lock.
+#define MAXORDER	11		// largest block is 2^(MAXORDER-1) pages
+#define MAGSIZE		32
+#define MAGBATCH	16
+
+// Pages already filled with zeros, for page_alloc(ALLOC_ZERO).  CPUs
+// with nothing to run fill it (see page_zero_idle); it holds at most
+// ZEROPOOL_MAX pages, and page_alloc falls back on it when everything
+// else is gone.  Also under page_lock.
+#define ZEROPOOL_MAX	256
+#define ZEROBATCH	16
+
+struct Magazine {
+	int m_n;
+	struct PageInfo *m_pages[MAGSIZE];
+};
+
+static struct PageInfo *free_area[MAXORDER];
+static struct Magazine magazines[NCPU];
+static struct PageInfo *zero_pool;
+static int nzero;
+
+// Free pages at or above HIGHMEM, which only page_alloc(ALLOC_HIGH)
+// hands out.  They skip the buddy pool and the magazines: nobody needs
+// them contiguous, and the kernel could not clear or check them without
+// kmap anyway.  Also under page_lock.
+static struct PageInfo *high_free;
+static size_t nhigh_free;
+
+// Each CPU has KMAPSLOTS windows at KMAPBASE (see kmap); kmap_pt is
+// the page table that maps them.
+#define KMAPSLOTS	2
+static pte_t *kmap_pt;
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+static uint32_t kern_cr4;	// CR4_PSE and CR4_PGE, if the CPU has them
+static uint32_t kern_pte_g;	// PTE_G, if the CPU has global pages
+static bool tlb_batching;	// see tlb_batch_begin
+static bool tlb_stale;
 
 
 // --------------------------------------------------------------
@@ -34,7 +83,7 @@ nvram_read(int r)
 static void
 i386_detect_memory(void)
 {
-	size_t basemem, extmem, ext16mem, totalmem;
+	size_t basemem, extmem, ext16mem, totalmem, highmem;
 
 	// Use CMOS calls to measure available base & extended memory.
 	// (CMOS calls return results in kilobytes.)
@@ -56,6 +105,21 @@ i386_detect_memory(void)
 
 	cprintf("Physical memory: %uK available, base = %uK, extended = %uK\n",
 		totalmem, basemem, totalmem - basemem);
+
+	// Without PAE, memory above 4GB is out of reach.  Below that,
+	// every page needs a struct PageInfo in the window at UPAGES.
+	highmem = (nvram_read(NVRAM_HIGHMEM)
+		   | mc146818_read(NVRAM_HIGHMEM + 2) << 16) * 64;
+	if (highmem)
+		cprintf("Physical memory: %uK above 4GB not usable\n", highmem);
+	if (npages > UPAGES_SIZE / sizeof(struct PageInfo)) {
+		npages = UPAGES_SIZE / sizeof(struct PageInfo);
+		cprintf("Physical memory: using only the first %uK\n",
+			npages * (PGSIZE / 1024));
+	}
+	if (npages > PGNUM(HIGHMEM))
+		cprintf("Physical memory: %uK above HIGHMEM, for user pages\n",
+			(npages - PGNUM(HIGHMEM)) * (PGSIZE / 1024));
 }
 
 
@@ -64,7 +128,10 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void boot_map_entry(physaddr_t limit);
+static void pool_free(struct PageInfo *pp, int order);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void check_kern_pgdir(void);
@@ -83,7 +150,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page allocator has been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -113,6 +180,28 @@ boot_alloc(uint32_t n)
 	return result;
 }
 
+// Extend entry_pgdir's mapping of physical memory at KERNBASE, which
+// covers only the first 4MB, to [0, limit), so that mem_init can use
+// what boot_alloc returns before kern_pgdir is loaded.  The page
+// tables come from boot_alloc, inside what is mapped already.
+static void
+boot_map_entry(physaddr_t limit)
+{
+	extern pde_t entry_pgdir[];
+	physaddr_t pa;
+	pte_t *pt;
+	int i;
+
+	for (pa = PTSIZE; pa < limit && pa < HIGHMEM; pa += PTSIZE) {
+		if (entry_pgdir[PDX(KERNBASE + pa)] & PTE_P)
+			continue;
+		pt = (pte_t *) boot_alloc(PGSIZE);
+		for (i = 0; i < NPTENTRIES; i++)
+			pt[i] = (pa + i * PGSIZE) | PTE_P | PTE_W;
+		entry_pgdir[PDX(KERNBASE + pa)] = PADDR(pt) | PTE_P | PTE_W;
+	}
+}
+
 // Set up a two-level page table:
 //    kern_pgdir is its linear (virtual) address of the root
 //
@@ -125,12 +214,35 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
 	size_t n;
 
+	static_assert(NENV * sizeof(struct Env) <= UENVS_SIZE);
+	static_assert(NCPU * KMAPSLOTS * PGSIZE <= KMAPSIZE);
+	static_assert(KMAPBASE + KMAPSIZE
+		      <= KSTACKTOP - NCPU * (KSTKSIZE + KSTKGAP));
+
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+	// With a lot of memory, the pages array alone outgrows the 4MB
+	// that entry_pgdir maps.  Leave room for the pages that the
+	// checks below touch, too.
+	boot_map_entry(PADDR(boot_alloc(0)) + PGSIZE
+		       + ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE)
+		       + ROUNDUP(NENV * sizeof(struct Env), PGSIZE) + PTSIZE);
+
+	// The mappings above UTOP are the same in every address space, so
+	// make them global: then the lcr3 in env_run leaves them in the
+	// TLB.  And map KERNBASE with 4MB pages, which need no page tables.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_PSE)
+		kern_cr4 |= CR4_PSE;
+	if (edx & CPUID_PGE) {
+		kern_cr4 |= CR4_PGE;
+		kern_pte_g = PTE_G;
+	}
+
 	// Remove this line when you're ready to test this function.
 //	panic("mem_init: This function is not finished\n");
 
@@ -201,7 +313,9 @@ mem_init(void)
 	boot_map_region(kern_pgdir, UPAGES, ROUNDUP(n, PGSIZE), PADDR(pages), PTE_U);
 
 	boot_map_region(kern_pgdir, UENVS, ROUNDUP(size_envs, PGSIZE), PADDR(envs), PTE_U);
+	pgdir_walk(kern_pgdir, (void*)(UVPT - PGSIZE), 1);
 	pgdir_walk(kern_pgdir, (void*)MMIOBASE, 1);
+	kmap_pt = pgdir_walk(kern_pgdir, (void*)KMAPBASE, 1);
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
 	// stack.  The kernel stack grows down from virtual address KSTACKTOP.
@@ -226,7 +340,10 @@ mem_init(void)
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
 
-	boot_map_region(kern_pgdir, KERNBASE, ~KERNBASE+1, 0, PTE_W);
+	if (kern_cr4 & CR4_PSE)
+		boot_map_region_large(kern_pgdir, KERNBASE, ~KERNBASE+1, 0, PTE_W);
+	else
+		boot_map_region(kern_pgdir, KERNBASE, ~KERNBASE+1, 0, PTE_W);
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
 
@@ -240,7 +357,7 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 
 	check_page_free_list(0);
 
@@ -255,6 +372,16 @@ mem_init(void)
 	check_page_installed_pgdir();
 }
 
+// Turn on the paging features kern_pgdir relies on and switch this CPU
+// to kern_pgdir.  CR4_PSE must be on before a page directory with 4MB
+// entries is loaded.
+void
+mem_init_percpu(void)
+{
+	lcr4(rcr4() | kern_cr4);
+	lcr3(PADDR(kern_pgdir));
+}
+
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
@@ -293,7 +420,7 @@ mem_init_mp(void)
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the page allocator.
 //
 void
 page_init(void)
@@ -319,22 +446,108 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
+	// Free the pages from the top down, so that the lowest blocks end
+	// up first on their free lists: until mem_init loads kern_pgdir,
+	// only the low 4MB of physical memory is mapped.
 	size_t i;
 	size_t nowend_pg = PGNUM( PADDR(boot_alloc(0)) );
+	for (i = npages - 1; i >= PGNUM(HIGHMEM); i--) {
+		pages[i].pp_link = high_free;
+		high_free = &pages[i];
+		nhigh_free++;
+	}
+	for (i = MIN(npages, PGNUM(HIGHMEM)) - 1; i >= nowend_pg; i--)
+		pool_free(&pages[i], 0);
 	for (i = npages_basemem - 1; i >= 1; i--) {
 		if ( i == MPENTRY_PADDR / PGSIZE ){
 			continue;
 		}
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+		pool_free(&pages[i], 0);
 	}
-	for (i = npages - 1; i >= nowend_pg; i--) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = page_free_list;
-		page_free_list = &pages[i];
+}
+
+// Put the block of 2^order pages starting at pp on its free list.
+static void
+pool_insert(struct PageInfo *pp, int order)
+{
+	pp->pp_free = 1;
+	pp->pp_order = order;
+	pp->pp_link = free_area[order];
+	pp->pp_pprev = &free_area[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = &pp->pp_link;
+	free_area[order] = pp;
+}
+
+// Take the free block starting at pp off its free list.
+static void
+pool_remove(struct PageInfo *pp)
+{
+	*pp->pp_pprev = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = pp->pp_pprev;
+	pp->pp_link = NULL;
+	pp->pp_free = 0;
+}
+
+// Allocate a block of 2^order pages from the buddy pool, splitting a
+// larger block if need be.  The lower half of a split block is the one
+// kept, so allocations stay low in memory.  Returns NULL if there is no
+// free block that large.
+static struct PageInfo *
+pool_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k < MAXORDER && !free_area[k]; k++)
+		;
+	if (k == MAXORDER)
+		return NULL;
+	pp = free_area[k];
+	pool_remove(pp);
+	while (k > order) {
+		k--;
+		pool_insert(pp + (1 << k), k);
+	}
+	return pp;
+}
+
+// Return the block of 2^order pages starting at pp to the buddy pool,
+// merging it with its buddy for as long as the buddy is free.
+static void
+pool_free(struct PageInfo *pp, int order)
+{
+	size_t i = pp - pages, buddy;
+
+	while (order < MAXORDER - 1) {
+		buddy = i ^ (1 << order);
+		if (buddy >= npages || !pages[buddy].pp_free
+		    || pages[buddy].pp_order != order)
+			break;
+		pool_remove(&pages[buddy]);
+		i &= ~(1 << order);
+		order++;
+	}
+	pool_insert(&pages[i], order);
+}
+
+// Return the n pages starting at pp to the buddy pool, in the largest
+// aligned blocks that fit.
+static void
+pool_free_range(struct PageInfo *pp, size_t n)
+{
+	size_t i = pp - pages, end = i + n;
+	int order;
+
+	while (i < end) {
+		for (order = 0; order < MAXORDER - 1
+			     && i % (2 << order) == 0 && i + (2 << order) <= end;
+		     order++)
+			;
+		pool_free(&pages[i], order);
+		i += 1 << order;
 	}
-	
 }
 
 //
@@ -343,45 +556,192 @@ page_init(void)
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// The page comes from this CPU's magazine, which is refilled from the
+// buddy pool when empty.  ALLOC_ZERO takes a page from the zero pool
+// first, so that it needs no clearing.  ALLOC_HIGH says the caller
+// reaches the page only through user mappings or kmap, so it may be
+// above HIGHMEM; such pages are used first, to save the ones the
+// kernel can address.  The zero pool may hold them too.
 //
 // Returns NULL if out of free memory.
-//
-// Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	if (!page_free_list){
-		return NULL;
+	struct Magazine *m = &magazines[cpunum()];
+	struct PageInfo *pp;
+
+	if ((alloc_flags & ALLOC_ZERO) && zero_pool) {
+		spin_lock(&page_lock);
+		if ((pp = zero_pool)
+		    && ((alloc_flags & ALLOC_HIGH) || page2pa(pp) < HIGHMEM)) {
+			zero_pool = pp->pp_link;
+			nzero--;
+		} else
+			pp = NULL;
+		spin_unlock(&page_lock);
+		if (pp) {
+			pp->pp_link = NULL;
+			return pp;
+		}
 	}
-	void *pg = page2kva( page_free_list );
-	struct PageInfo *old_free = page_free_list;
-	page_free_list = old_free->pp_link;
-	old_free->pp_link = NULL;
+	if ((alloc_flags & ALLOC_HIGH) && high_free) {
+		spin_lock(&page_lock);
+		if ((pp = high_free)) {
+			high_free = pp->pp_link;
+			nhigh_free--;
+		}
+		spin_unlock(&page_lock);
+		if (pp) {
+			pp->pp_link = NULL;
+			if (alloc_flags & ALLOC_ZERO)
+				memset(kmap(pp, 0), 0, PGSIZE);
+			return pp;
+		}
+	}
+	if (m->m_n == 0) {
+		spin_lock(&page_lock);
+		while (m->m_n < MAGBATCH && (pp = pool_alloc(0)))
+			m->m_pages[m->m_n++] = pp;
+		if (m->m_n == 0 && (pp = zero_pool) && page2pa(pp) < HIGHMEM) {
+			zero_pool = pp->pp_link;
+			nzero--;
+			m->m_pages[m->m_n++] = pp;
+		}
+		spin_unlock(&page_lock);
+		if (m->m_n == 0)
+			return NULL;
+	}
+	pp = m->m_pages[--m->m_n];
+	pp->pp_link = NULL;
 
 	if ( alloc_flags & ALLOC_ZERO ){
-		memset(pg, 0, PGSIZE);
+		memset(page2kva(pp), 0, PGSIZE);
 	}
-	return old_free;
+	return pp;
 }
 
 //
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
+// The page goes to this CPU's magazine; a full magazine first drains
+// its oldest MAGBATCH pages to the buddy pool.
+//
 void
 page_free(struct PageInfo *pp)
 {
-	// Fill this function in
-	// Hint: You may want to panic if pp->pp_ref is nonzero or
-	// pp->pp_link is not NULL.
+	struct Magazine *m = &magazines[cpunum()];
+	int i;
 
 	if ( pp->pp_ref != 0 ){
 		panic("page_free: free a physical page of pp_ref != 0\n");
 	}
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	if (page2pa(pp) >= HIGHMEM) {
+		spin_lock(&page_lock);
+		pp->pp_link = high_free;
+		high_free = pp;
+		nhigh_free++;
+		spin_unlock(&page_lock);
+		return;
+	}
+	if (m->m_n == MAGSIZE) {
+		spin_lock(&page_lock);
+		for (i = 0; i < MAGBATCH; i++)
+			pool_free(m->m_pages[i], 0);
+		spin_unlock(&page_lock);
+		memmove(m->m_pages, m->m_pages + MAGBATCH,
+			(MAGSIZE - MAGBATCH) * sizeof(m->m_pages[0]));
+		m->m_n -= MAGBATCH;
+	}
+	m->m_pages[m->m_n++] = pp;
+}
+
+//
+// Clear up to ZEROBATCH free pages and put them in the zero pool,
+// unless it is full.  Called by CPUs about to halt, without the big
+// kernel lock, so nzero is only a hint outside page_lock.
+//
+void
+page_zero_idle(void)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < ZEROBATCH && nzero < ZEROPOOL_MAX; i++) {
+		if (!(pp = page_alloc(ALLOC_HIGH)))
+			break;
+		memset(kmap(pp, 0), 0, PGSIZE);
+		spin_lock(&page_lock);
+		pp->pp_link = zero_pool;
+		zero_pool = pp;
+		nzero++;
+		spin_unlock(&page_lock);
+	}
+}
+
+//
+// Return a kernel virtual address for page pp: its address at KERNBASE
+// if it has one, or else window 'slot' (0 to KMAPSLOTS-1) of this CPU,
+// remapped to pp.  The window stays valid until this CPU next uses the
+// same slot.
+//
+void *
+kmap(struct PageInfo *pp, int slot)
+{
+	uintptr_t va;
+
+	if (page2pa(pp) < HIGHMEM)
+		return page2kva(pp);
+	assert(slot >= 0 && slot < KMAPSLOTS);
+	va = KMAPBASE + (cpunum() * KMAPSLOTS + slot) * PGSIZE;
+	kmap_pt[PTX(va)] = page2pa(pp) | PTE_P | PTE_W;
+	invlpg((void *) va);
+	return (void *) va;
+}
+
+//
+// Allocate n physically contiguous pages, for device rings and DMA
+// buffers.  The run comes from a buddy block rounded up to a power of
+// two; the pages past n go straight back to the pool.  Like
+// page_alloc, does not touch reference counts.
+//
+// Returns the first page, or NULL if there is no free run that long.
+struct PageInfo *
+page_alloc_npages(size_t n, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int order;
+
+	for (order = 0; order < MAXORDER && (1U << order) < n; order++)
+		;
+	if (n == 0 || order == MAXORDER)
+		return NULL;
+
+	spin_lock(&page_lock);
+	if ((pp = pool_alloc(order)) && n < (1U << order))
+		pool_free_range(pp + n, (1 << order) - n);
+	spin_unlock(&page_lock);
+
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, n * PGSIZE);
+	return pp;
+}
+
+//
+// Return n contiguous pages starting at pp, as allocated by
+// page_alloc_npages, to the free pool.
+//
+void
+page_free_npages(struct PageInfo *pp, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (pp[i].pp_ref != 0)
+			panic("page_free_npages: page %d of %d has pp_ref != 0", i, n);
+	spin_lock(&page_lock);
+	pool_free_range(pp, n);
+	spin_unlock(&page_lock);
 }
 
 //
@@ -395,6 +755,66 @@ page_decref(struct PageInfo* pp)
 		page_free(pp);
 }
 
+//
+// Page tables below UTOP may be shared between page directories (see
+// pgdir_copy_cow); the table page's pp_ref counts the directories that
+// use it, and the mapped pages are referenced once per table, not once
+// per directory.  A shared table holds only plain read-only entries --
+// no PTE_W, PTE_COW or PTE_SHARE -- and is never written: whatever
+// changes an entry in it first calls pt_unshare.
+//
+
+// Can the page table pt be shared?  It must map something, and
+// nothing in it may be written through or have its pp_ref consulted.
+static bool
+pt_shareable(pte_t *pt)
+{
+	bool any = 0;
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		if (!(pt[i] & PTE_P))
+			continue;
+		if (pt[i] & (PTE_W|PTE_COW|PTE_SHARE))
+			return 0;
+		any = 1;
+	}
+	return any;
+}
+
+static bool
+pt_shared(pde_t *pgdir, const void *va)
+{
+	return (uintptr_t) va < UTOP && (pgdir[PDX(va)] & PTE_P)
+		&& pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_ref > 1;
+}
+
+// Give pgdir a private copy of the page table covering va, if it
+// shares that table.  Returns 0 or -E_NO_MEM.
+static int
+pt_unshare(pde_t *pgdir, const void *va)
+{
+	struct PageInfo *pp;
+	pte_t *old, *new;
+	int i;
+
+	if (!pt_shared(pgdir, va))
+		return 0;
+	if (!(pp = page_alloc(0)))
+		return -E_NO_MEM;
+	pp->pp_ref++;
+	old = (pte_t *) KADDR(PTE_ADDR(pgdir[PDX(va)]));
+	new = (pte_t *) page2kva(pp);
+	memcpy(new, old, PGSIZE);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (new[i] & PTE_P)
+			pa2page(PTE_ADDR(new[i]))->pp_ref++;
+	page_decref(pa2page(PADDR(old)));
+	// Same translations as before, so the TLB stays valid.
+	pgdir[PDX(va)] = page2pa(pp) | PTE_P | PTE_U | PTE_W;
+	return 0;
+}
+
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
@@ -406,6 +826,9 @@ page_decref(struct PageInfo* pp)
 //    - Otherwise, the new page's reference count is incremented,
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
+// With create, a shared user page table is first replaced by a private
+// copy, since the caller means to write the entry; if that fails,
+// pgdir_walk returns NULL.
 //
 // Hint 1: you can turn a PageInfo * into the physical address of the
 // page it refers to with page2pa() from kern/pmap.h.
@@ -430,6 +853,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		}
 		p->pp_ref++;
 		pgdir[PDX(va)] = page2pa(p) | PTE_P | PTE_U | PTE_W;
+	} else if ( create && pt_unshare(pgdir, va) < 0 ){
+		return NULL;
 	}
 	pte_t *ptbase = (pte_t*)KADDR( PTE_ADDR(pgdir[PDX(va)]) );
 	return ptbase + PTX(va);
@@ -443,7 +868,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 //
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
-// mapped pages.
+// mapped pages.  Since they are the same in every address space, the
+// entries are global where the CPU supports it.
 //
 // Hint: the TA solution uses pgdir_walk
 static void
@@ -454,10 +880,22 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 		if ( !pte ){
 			panic("boot_map_region: out of new page table failed\n");
 		}
-		*pte = (pa+i) | perm | PTE_P;
+		*pte = (pa+i) | perm | kern_pte_g | PTE_P;
 	}
 }
 
+// Like boot_map_region, but with 4MB pages: va, pa and size must be
+// multiples of PTSIZE, and the CPU must support CR4_PSE.
+static void
+boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm)
+{
+	size_t i;
+
+	assert(va % PTSIZE == 0 && pa % PTSIZE == 0 && size % PTSIZE == 0);
+	for (i = 0; i < size; i += PTSIZE)
+		pgdir[PDX(va + i)] = (pa + i) | perm | kern_pte_g | PTE_PS | PTE_P;
+}
+
 //
 // Map the physical page 'pp' at virtual address 'va'.
 // The permissions (the low 12 bits) of the page table entry
@@ -540,16 +978,110 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 void
 page_remove(pde_t *pgdir, void *va)
 {
-	pte_t *pte_store;
-	struct PageInfo *pinfo = page_lookup(pgdir, va, &pte_store);
-	if (!pinfo){
+	// An entry for a page not filled in yet (see kern/pager.c) holds
+	// no page, but it goes away too.
+	pte_t *pte_store = pgdir_walk(pgdir, va, 0);
+	if ( !pte_store || !*pte_store ){
 		return;
 	}
-	page_decref(pinfo);
-	tlb_invalidate(pgdir, va);
+	if ( pt_shared(pgdir, va) ){
+		if ( pt_unshare(pgdir, va) < 0 ){
+			panic("page_remove: no memory to unshare a page table");
+		}
+		pte_store = pgdir_walk(pgdir, va, 0);
+	}
+	if ( *pte_store & PTE_P ){
+		page_decref(pa2page(PTE_ADDR(*pte_store)));
+		tlb_invalidate(pgdir, va);
+	}
 	*pte_store = 0x0;
 }
 
+//
+// Share the user mappings of src below limit with dst, copy-on-write.
+// Writable and copy-on-write pages become read-only PTE_COW in both
+// address spaces; PTE_SHARE and read-only pages are mapped as they are.
+// Entries for pages not filled in yet are copied as they are.  Every
+// copied entry takes a reference on its page, except that a page table
+// wholly below limit holding only plain read-only entries is shared
+// instead of copied.  Callers pass USTACKTOP, leaving the exception
+// stack out.  The caller must flush src's TLB afterwards.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated; dst then holds
+//   whatever was copied so far
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t limit)
+{
+	uintptr_t va;
+	pte_t *spt, *dpt, pte;
+	int i;
+
+	for (va = 0; va < limit; va += PTSIZE) {
+		if (!(src[PDX(va)] & PTE_P))
+			continue;
+		spt = (pte_t *) KADDR(PTE_ADDR(src[PDX(va)]));
+		if (va + PTSIZE <= limit && pt_shareable(spt)) {
+			dst[PDX(va)] = src[PDX(va)];
+			pa2page(PTE_ADDR(src[PDX(va)]))->pp_ref++;
+			continue;
+		}
+		dpt = NULL;
+		for (i = 0; i < NPTENTRIES && va + i * PGSIZE < limit; i++) {
+			pte = spt[i];
+			if (!pte)
+				continue;
+			if (!dpt && !(dpt = pgdir_walk(dst, (void *) va, 1)))
+				return -E_NO_MEM;
+			if (!(pte & PTE_P)) {
+				// not filled in yet; see kern/pager.c
+				dpt[i] = pte;
+				continue;
+			}
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W|PTE_COW)))
+				spt[i] = pte = (pte & ~PTE_W) | PTE_COW;
+			dpt[i] = pte & (~0xFFF | PTE_SYSCALL);
+			pa2page(PTE_ADDR(pte))->pp_ref++;
+		}
+	}
+	return 0;
+}
+
+//
+// Resolve a write fault on the PTE_COW page at va in pgdir.  If no one
+// else maps the page any more it simply becomes writable again;
+// otherwise it is replaced by a private writable copy.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if va is not mapped copy-on-write
+//   -E_NO_MEM, if there is no memory for the copy
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp, *copy;
+	pte_t *pte;
+	int perm;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP || !(pp = page_lookup(pgdir, va, &pte))
+	    || !(*pte & PTE_COW))
+		return -E_INVAL;
+	perm = ((*pte & PTE_SYSCALL) & ~(PTE_COW|PTE_P)) | PTE_W;
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if (!(copy = page_alloc(ALLOC_HIGH)))
+		return -E_NO_MEM;
+	memcpy(kmap(copy, 0), kmap(pp, 1), PGSIZE);
+	return page_insert(pgdir, copy, va, perm);
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -558,8 +1090,34 @@ void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (tlb_batching)
+			tlb_stale = 1;
+		else
+			invlpg(va);
+	}
+}
+
+//
+// Between tlb_batch_begin and tlb_batch_end, tlb_invalidate only notes
+// that the current address space changed, and tlb_batch_end flushes the
+// whole TLB once if it did.  The big kernel lock keeps other CPUs out.
+//
+void
+tlb_batch_begin(void)
+{
+	tlb_batching = 1;
+	tlb_stale = 0;
+}
+
+void
+tlb_batch_end(void)
+{
+	tlb_batching = 0;
+	if (tlb_stale) {
+		tlb_stale = 0;
+		lcr3(rcr3());
+	}
 }
 
 //
@@ -641,6 +1199,12 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 	for ( uint8_t *walker = vstart; walker < vend; walker += PGSIZE ){
 		pinfo = page_lookup(env->env_pgdir, walker, &pte_store);
+		// Fill in or unshare the page if that is all it takes
+		// (see kern/pager.c); this may restart the system call.
+		if ( (pinfo == NULL || (~*pte_store & perm) != 0)
+		     && page_demand(env, walker, perm, 1) == 0 ){
+			pinfo = page_lookup(env->env_pgdir, walker, &pte_store);
+		}
 		if ( pinfo == NULL || (~*pte_store & perm) != 0 ){
 			user_mem_check_addr = (walker == vstart ? (uintptr_t)va : (uintptr_t)walker);
 			return -E_FAULT;
@@ -659,11 +1223,80 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
-		cprintf("[%08x] user_mem_check assertion failure for "
-			"va %08x\n", env->env_id, user_mem_check_addr);
-		env_destroy(env);	// may not return
+	if (user_mem_check(env, va, len, perm | PTE_U) < 0)
+		user_mem_fault(env);
+}
+
+//
+// Destroy 'env' for passing a bad address to user_mem_check, copyin or
+// copyout, which set user_mem_check_addr.  If env is the current
+// environment, this function will not return.
+//
+void
+user_mem_fault(struct Env *env)
+{
+	cprintf("[%08x] user_mem_check assertion failure for "
+		"va %08x\n", env->env_id, user_mem_check_addr);
+	env_destroy(env);	// may not return
+}
+
+int copy_user(void *dst, const void *src, size_t len);	// kern/copy.S
+
+// copyin and copyout accept only ranges below UTOP.  Not everything
+// mapped between UTOP and ULIM is PTE_U -- the UVPT window maps the
+// kernel's page tables and large pages -- so the MMU, running the copy
+// at CPL 0, would not catch an access there.
+static int
+copy_check(const void *uva, size_t len)
+{
+	if ((uintptr_t) uva >= UTOP || len > UTOP - (uintptr_t) uva) {
+		user_mem_check_addr = MAX((uintptr_t) uva, UTOP);
+		return -E_FAULT;
 	}
+	return 0;
+}
+
+//
+// Copy len bytes from usrc in the current environment's address space,
+// which must be loaded, to the kernel buffer dst.  Instead of checking
+// the pages first, as user_mem_check does, this checks only that the
+// range is below UTOP -- every mapping there is PTE_U -- and lets the
+// MMU find the rest: a fault in the copy makes copyin return -E_FAULT
+// (see copy_user), after page_fault_handler has tried filling in the
+// page (see kern/pager.c), which may restart the system call.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, with user_mem_check_addr set, if [usrc, usrc+len) is not
+//	readable by the environment
+//
+int
+copyin(void *dst, const void *usrc, size_t len)
+{
+	if (copy_check(usrc, len) < 0)
+		return -E_FAULT;
+	if (copy_user(dst, usrc, len) < 0) {
+		user_mem_check_addr = rcr2();
+		return -E_FAULT;
+	}
+	return 0;
+}
+
+//
+// Copy len bytes from the kernel buffer src to udst in the current
+// environment's address space, like copyin.  CR0_WP makes the MMU
+// check PTE_W for kernel writes, and copy-on-write pages are copied.
+//
+int
+copyout(void *udst, const void *src, size_t len)
+{
+	if (copy_check(udst, len) < 0)
+		return -E_FAULT;
+	if (copy_user(udst, src, len) < 0) {
+		user_mem_check_addr = rcr2();
+		return -E_FAULT;
+	}
+	return 0;
 }
 
 
@@ -672,7 +1305,100 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Free-page helpers for the checks below.
+//
+static struct PageInfo *stolen_area[MAXORDER];
+static struct Magazine stolen_mag;
+static struct PageInfo *stolen_zero;
+
+// Count the free pages, in the buddy pool and in every magazine.
+static int
+count_free_pages(void)
+{
+	struct PageInfo *pp;
+	int order, c, n = 0;
+
+	for (order = 0; order < MAXORDER; order++)
+		for (pp = free_area[order]; pp; pp = pp->pp_link)
+			n += 1 << order;
+	for (c = 0; c < NCPU; c++)
+		n += magazines[c].m_n;
+	return n + nzero;
+}
+
+// Temporarily take all free pages away from page_alloc.
+static void
+steal_free_pages(void)
+{
+	struct Magazine *m = &magazines[cpunum()];
+	int order;
+
+	for (order = 0; order < MAXORDER; order++) {
+		stolen_area[order] = free_area[order];
+		if (stolen_area[order])
+			stolen_area[order]->pp_pprev = &stolen_area[order];
+		free_area[order] = NULL;
+	}
+	stolen_mag = *m;
+	m->m_n = 0;
+	stolen_zero = zero_pool;
+	zero_pool = NULL;
+	nzero = 0;
+}
+
+// Give back the pages steal_free_pages took.
+static void
+return_free_pages(void)
+{
+	struct PageInfo *pp;
+	int order, i;
+
+	for (order = 0; order < MAXORDER; order++)
+		while ((pp = stolen_area[order])) {
+			pool_remove(pp);
+			pool_free(pp, order);
+		}
+	for (i = 0; i < stolen_mag.m_n; i++)
+		page_free(stolen_mag.m_pages[i]);
+	while ((pp = stolen_zero)) {
+		stolen_zero = pp->pp_link;
+		pp->pp_link = zero_pool;
+		zero_pool = pp;
+		nzero++;
+	}
+}
+
+// Check one page that is supposed to be free.
+static void
+check_free_page(struct PageInfo *pp, char *first_free_page,
+		int *nfree_basemem, int *nfree_extmem)
+{
+	// check that we didn't corrupt the free list itself
+	assert(pp >= pages);
+	assert(pp < pages + npages);
+	assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+	assert(pp->pp_ref == 0);
+
+	// check a few pages that shouldn't be on the free list
+	assert(page2pa(pp) != 0);
+	assert(page2pa(pp) != IOPHYSMEM);
+	assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+	assert(page2pa(pp) != EXTPHYSMEM);
+	assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+	// (new test for lab 4)
+	assert(page2pa(pp) != MPENTRY_PADDR);
+
+	if (page2pa(pp) < EXTPHYSMEM)
+		++*nfree_basemem;
+	else
+		++*nfree_extmem;
+}
+
+//
+// Check that the free pages are reasonable: that the buddy lists hold
+// properly aligned blocks and that no page is free that should not be.
+// With only_low_memory, only pages below 4MB are touched, since
+// entry_pgdir does not map the rest.
 //
 static void
 check_page_free_list(bool only_low_memory)
@@ -680,53 +1406,36 @@ check_page_free_list(bool only_low_memory)
 	struct PageInfo *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
+	int order, c, i;
 	char *first_free_page;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	if (!count_free_pages())
+		panic("no free pages!");
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (order = 0; order < MAXORDER; order++)
+		for (pp = free_area[order]; pp; pp = pp->pp_link)
+			for (i = 0; i < (1 << order); i++)
+				if (PDX(page2pa(pp + i)) < pdx_limit)
+					memset(page2kva(pp + i), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
-	}
+	for (order = 0; order < MAXORDER; order++)
+		for (pp = free_area[order]; pp; pp = pp->pp_link) {
+			assert(pp->pp_free && pp->pp_order == order);
+			assert((pp - pages) % (1 << order) == 0);
+			assert(*pp->pp_pprev == pp);
+			for (i = 0; i < (1 << order); i++)
+				check_free_page(pp + i, first_free_page,
+						&nfree_basemem, &nfree_extmem);
+		}
+	for (c = 0; c < NCPU; c++)
+		for (i = 0; i < magazines[c].m_n; i++) {
+			assert(!magazines[c].m_pages[i]->pp_free);
+			check_free_page(magazines[c].m_pages[i], first_free_page,
+					&nfree_basemem, &nfree_extmem);
+		}
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
@@ -743,7 +1452,6 @@ check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
 	char *c;
 	int i;
 
@@ -751,8 +1459,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = count_free_pages();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -768,8 +1475,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -797,7 +1503,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages();
 
 	// free the pages we took
 	page_free(pp0);
@@ -805,9 +1511,15 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == count_free_pages());
+
+	// a contiguous run is taken whole and merges back when freed
+	assert((pp = page_alloc_npages(5, 0)));
+	for (i = 0; i < 5; i++)
+		assert(!pp[i].pp_free && pp[i].pp_ref == 0);
+	assert(count_free_pages() == nfree - 5);
+	page_free_npages(pp, 5);
+	assert(count_free_pages() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -839,7 +1551,7 @@ check_kern_pgdir(void)
 		assert(check_va2pa(pgdir, UENVS + i) == PADDR(envs) + i);
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
+	for (i = 0; i < MIN(npages, PGNUM(HIGHMEM)) * PGSIZE; i += PGSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
 	// check kernel stack
@@ -858,8 +1570,8 @@ check_kern_pgdir(void)
 		switch (i) {
 		case PDX(UVPT):
 		case PDX(KSTACKTOP-1):
-		case PDX(UPAGES):
-		case PDX(UENVS):
+		case PDX(UENVS):	// and the start of UPAGES
+		case PDX(UVPT-1):	// the rest of UPAGES
 		case PDX(MMIOBASE):
 			assert(pgdir[i] & PTE_P);
 			break;
@@ -888,6 +1600,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return (*pgdir & ~(PTSIZE - 1)) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -900,7 +1614,6 @@ static void
 check_page(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
 	pte_t *ptep, *ptep1;
 	void *va;
 	uintptr_t mm1, mm2;
@@ -918,8 +1631,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1039,7 +1751,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages();
 
 	// free the pages we took
 	page_free(pp0);
@@ -1077,7 +1789,6 @@ static void
 check_page_installed_pgdir(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
-	struct PageInfo *fl;
 	pte_t *ptep, *ptep1;
 	uintptr_t va;
 	int i;
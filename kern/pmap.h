@@ -33,6 +33,11 @@ _paddr(const char *file, int line, void *kva)
 	return (physaddr_t)kva - KERNBASE;
 }
 
+/* Physical memory from HIGHMEM up is not mapped at KERNBASE.  Only user
+ * pages live there, allocated with ALLOC_HIGH; the kernel reaches them
+ * through user mappings or kmap. */
+#define HIGHMEM		((physaddr_t) -KERNBASE)
+
 /* This macro takes a physical address and returns the corresponding kernel
  * virtual address.  It panics if you pass an invalid physical address. */
 #define KADDR(pa) _kaddr(__FILE__, __LINE__, pa)
@@ -40,7 +45,7 @@ _paddr(const char *file, int line, void *kva)
 static inline void*
 _kaddr(const char *file, int line, physaddr_t pa)
 {
-	if (PGNUM(pa) >= npages)
+	if (PGNUM(pa) >= npages || pa >= HIGHMEM)
 		_panic(file, line, "KADDR called with invalid pa %08lx", pa);
 	return (void *)(pa + KERNBASE);
 }
@@ -49,24 +54,38 @@ _kaddr(const char *file, int line, physaddr_t pa)
 enum {
 	// For page_alloc, zero the returned physical page.
 	ALLOC_ZERO = 1<<0,
+	// For page_alloc, the page may come from above HIGHMEM.
+	ALLOC_HIGH = 1<<1,
 };
 
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_npages(size_t n, int alloc_flags);
+void	page_free_npages(struct PageInfo *pp, size_t n);
+void	page_zero_idle(void);
+void *	kmap(struct PageInfo *pp, int slot);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+int	pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t limit);
+int	page_cow_fault(pde_t *pgdir, void *va);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void	user_mem_fault(struct Env *env);
+int	copyin(void *dst, const void *usrc, size_t len);
+int	copyout(void *udst, const void *src, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -13,6 +13,8 @@
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/picirq.h>
+#include <kern/pager.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -20,10 +22,22 @@
 static void
 sys_cputs(const char *s, size_t len)
 {
+	char buf[256];
+
 	// Check that the user has permission to read memory [s, s+len).
 	// Destroy the environment if not.
 	assert( curenv );
-	user_mem_assert(curenv, s, len, PTE_U );
+	// Short strings -- nearly all of them, since lib/printf.c sends
+	// at most 256 bytes at a time -- are copied in whole before any
+	// is printed; longer ones are checked page by page first.
+	if ( len <= sizeof(buf) ){
+		if ( copyin(buf, s, len) < 0 ){
+			user_mem_fault(curenv);
+		}
+		s = buf;
+	} else {
+		user_mem_assert(curenv, s, len, PTE_U );
+	}
 	// LAB 3: Your code here.
 
 	// Print the string supplied by the user.
@@ -95,6 +109,78 @@ sys_exofork(void)
 	return e->env_id;
 }
 
+// Fork the current environment in one go: allocate a child as
+// sys_exofork does, share our user address space with it copy-on-write
+// (see pgdir_copy_cow), give it a fresh exception stack, our page
+// fault upcall and our pager, and mark it runnable.  page_cow_fault
+// resolves the PTE_COW faults either side takes later.
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork_cow(void)
+{
+	struct Env *e;
+	struct PageInfo *pp;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_pager = curenv->env_pager;
+	e->env_pager_fileid = curenv->env_pager_fileid;
+	e->env_pager_req = curenv->env_pager_req;
+
+	r = pgdir_copy_cow(e->env_pgdir, curenv->env_pgdir, USTACKTOP);
+	// Our writable entries may have turned read-only even on failure.
+	lcr3(PADDR(curenv->env_pgdir));
+	if (r < 0)
+		goto fail;
+	if (curenv->env_pgfault_upcall) {
+		r = -E_NO_MEM;
+		if (!(pp = page_alloc(ALLOC_ZERO|ALLOC_HIGH)))
+			goto fail;
+		if ((r = page_insert(e->env_pgdir, pp, (void *) (UXSTACKTOP - PGSIZE),
+				     PTE_U|PTE_W)) < 0) {
+			page_free(pp);
+			goto fail;
+		}
+	}
+	e->env_status = ENV_RUNNABLE;
+	return e->env_id;
+
+fail:
+	env_free(e);
+	return r;
+}
+
+// Make the file server pagerid, and its open file fileid, the pager for
+// envid's PTE_FILE pages (see kern/pager.c).  Page-in requests are
+// written into the page at reqva in envid's address space, which must
+// stay mapped.  envid must keep the file open for as long as it has
+// PTE_FILE pages.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid or pagerid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if reqva >= UTOP or reqva is not page-aligned.
+static int
+sys_env_set_pager(envid_t envid, envid_t pagerid, int fileid, void *reqva)
+{
+	struct Env *e, *pager;
+
+	if (envid2env(envid, &e, 1) < 0 || envid2env(pagerid, &pager, 0) < 0)
+		return -E_BAD_ENV;
+	if ((uintptr_t) reqva >= UTOP || (uintptr_t) reqva % PGSIZE)
+		return -E_INVAL;
+	e->env_pager = pager->env_id;
+	e->env_pager_fileid = fileid;
+	e->env_pager_req = reqva;
+	return 0;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -210,7 +296,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if ( envid2env(envid, &e, 1) < 0){
 		return -E_BAD_ENV;
 	}
-	struct PageInfo *pinfo = page_alloc(0);
+	struct PageInfo *pinfo = page_alloc(ALLOC_ZERO|ALLOC_HIGH);
 	if ( !pinfo ){
 		return -E_NO_MEM;
 	}
@@ -261,6 +347,9 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	}
 	pte_t *store;
 	struct PageInfo *pinfo = page_lookup(srcenv->env_pgdir, srcva, &store);
+	if ( !pinfo && page_demand(srcenv, srcva, 0, 1) == 0 ){
+		pinfo = page_lookup(srcenv->env_pgdir, srcva, &store);
+	}
 	if ( !pinfo ){
 		return -E_INVAL;
 	}
@@ -304,6 +393,165 @@ sys_page_unmap(envid_t envid, void *va)
 	//panic("sys_page_unmap not implemented");
 }
 
+// Caches the last envid2env answer, so a batch of page requests checks
+// each environment once.
+struct EnvCache {
+	envid_t ec_envid;
+	struct Env *ec_env;
+};
+
+static int
+batch_env(envid_t envid, struct EnvCache *ec, struct Env **env_store)
+{
+	if (!ec->ec_env || ec->ec_envid != envid) {
+		if (envid2env(envid, &ec->ec_env, 1) < 0) {
+			ec->ec_env = NULL;
+			return -E_BAD_ENV;
+		}
+		ec->ec_envid = envid;
+	}
+	*env_store = ec->ec_env;
+	return 0;
+}
+
+// Apply one PageMap request; see sys_page_map_range.
+static int
+page_map_one(struct PageMap *pm, struct EnvCache *srccache, struct EnvCache *dstcache)
+{
+	struct Env *srcenv = NULL, *dstenv;
+	struct PageInfo *pp;
+	uintptr_t srcva, dstva;
+	pte_t *pte;
+	int i, r;
+
+	if (pm->pm_npages < 0 || pm->pm_npages > UTOP / PGSIZE
+	    || pm->pm_dstva % PGSIZE
+	    || pm->pm_dstva + (uintptr_t) pm->pm_npages * PGSIZE > UTOP
+	    || pm->pm_dstva + (uintptr_t) pm->pm_npages * PGSIZE < pm->pm_dstva)
+		return -E_INVAL;
+	if (pm->pm_op != PM_UNMAP && (pm->pm_perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	if ((r = batch_env(pm->pm_dstenv, dstcache, &dstenv)) < 0)
+		return r;
+	if (pm->pm_op == PM_MAP) {
+		if (pm->pm_srcva % PGSIZE
+		    || pm->pm_srcva + (uintptr_t) pm->pm_npages * PGSIZE > UTOP
+		    || pm->pm_srcva + (uintptr_t) pm->pm_npages * PGSIZE < pm->pm_srcva)
+			return -E_INVAL;
+		if ((r = batch_env(pm->pm_srcenv, srccache, &srcenv)) < 0)
+			return r;
+	} else if (pm->pm_op == PM_ZERO || pm->pm_op == PM_FILE) {
+		// The entry keeps only PTE_W and PTE_U (see inc/mmu.h)
+		if (pm->pm_perm & ~(PTE_P|PTE_U|PTE_W))
+			return -E_INVAL;
+		pm->pm_perm &= ~PTE_P;
+		if (pm->pm_op == PM_FILE && (pm->pm_srcva % PGSIZE
+		    || pm->pm_srcva + (uintptr_t) pm->pm_npages * PGSIZE < pm->pm_srcva))
+			return -E_INVAL;
+	} else if (pm->pm_op != PM_ALLOC && pm->pm_op != PM_UNMAP)
+		return -E_INVAL;
+
+	for (i = 0; i < pm->pm_npages; i++) {
+		srcva = pm->pm_srcva + i * PGSIZE;
+		dstva = pm->pm_dstva + i * PGSIZE;
+		switch (pm->pm_op) {
+		case PM_ALLOC:
+			if (!(pp = page_alloc(ALLOC_ZERO|ALLOC_HIGH)))
+				return -E_NO_MEM;
+			if (page_insert(dstenv->env_pgdir, pp, (void *) dstva,
+					pm->pm_perm|PTE_U) < 0) {
+				page_free(pp);
+				return -E_NO_MEM;
+			}
+			break;
+		case PM_MAP:
+			if (!(pp = page_lookup(srcenv->env_pgdir, (void *) srcva, &pte))
+			    && page_demand(srcenv, (void *) srcva, 0, 1) == 0)
+				pp = page_lookup(srcenv->env_pgdir, (void *) srcva, &pte);
+			if (!pp)
+				return -E_INVAL;
+			if ((pm->pm_perm & PTE_W) && !(*pte & PTE_W))
+				return -E_INVAL;
+			if (page_insert(dstenv->env_pgdir, pp, (void *) dstva,
+					pm->pm_perm|PTE_U) < 0)
+				return -E_NO_MEM;
+			break;
+		case PM_UNMAP:
+			page_remove(dstenv->env_pgdir, (void *) dstva);
+			break;
+		case PM_ZERO:
+			if (page_set_lazy(dstenv->env_pgdir, (void *) dstva,
+					  PTE_ZFOD|pm->pm_perm|PTE_U) < 0)
+				return -E_NO_MEM;
+			break;
+		case PM_FILE:
+			if (page_set_lazy(dstenv->env_pgdir, (void *) dstva,
+					  PTE_FILE|pm->pm_perm|PTE_U|srcva) < 0)
+				return -E_NO_MEM;
+			break;
+		}
+	}
+	return 0;
+}
+
+// Apply the n requests in maps, in order, in one trap.  Each request
+// allocates, maps or unmaps a run of pages with the same checks as
+// sys_page_alloc, sys_page_map and sys_page_unmap, or replaces them
+// with pages to be filled in on first touch (see kern/pager.c); PM_FILE
+// pages come from the pager set with sys_env_set_pager.  Environments are
+// looked up once per batch rather than once per page, and the TLB is
+// flushed at most once at the end.
+//
+// Return 0 on success, < 0 on error.  On error the requests before the
+// failing page have taken effect.  Errors are those of the three calls
+// above, plus:
+//	-E_INVAL if n is negative or above PGSIZE, or a request has an
+//		unknown op or a range that runs past UTOP.
+static int
+sys_page_map_range(const struct PageMap *maps, int n)
+{
+	struct EnvCache srccache = { 0, NULL }, dstcache = { 0, NULL };
+	struct PageMap pm;
+	int i, r = 0;
+
+	if (n < 0 || n > PGSIZE)
+		return -E_INVAL;
+
+	tlb_batch_begin();
+	for (i = 0; i < n && r >= 0; i++) {
+		if (copyin(&pm, &maps[i], sizeof(pm)) < 0) {
+			tlb_batch_end();
+			user_mem_fault(curenv);
+		}
+		r = page_map_one(&pm, &srccache, &dstcache);
+	}
+	tlb_batch_end();
+	return r;
+}
+
+// Deliver an IPC from 'from' to e, which must be receiving: map page pp,
+// if any, at e's env_ipc_dstva with perm (if e wants a page), record
+// the message, and make e's sys_ipc_recv return 0.
+// Returns 0, or -E_NO_MEM if there's no memory for the mapping.
+int
+ipc_deliver(struct Env *e, envid_t from, uint32_t value, struct PageInfo *pp, int perm)
+{
+	if ( pp && (uintptr_t)e->env_ipc_dstva < UTOP ){
+		if ( page_insert(e->env_pgdir, pp, e->env_ipc_dstva, perm|PTE_U) < 0 ){
+			return -E_NO_MEM;
+		}
+	} else {
+		pp = NULL;
+	}
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = from;
+	e->env_ipc_value = value;
+	e->env_ipc_perm = (pp ? (perm|PTE_P|PTE_U) : 0);
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_status = ENV_RUNNABLE;
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -347,8 +595,8 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	struct Env *env_store;
-	int ispg = 0;
-	int r;
+	struct PageInfo *pinfo = NULL;
+	pte_t *pentry;
 	if ( envid2env(envid, &env_store, 0) < 0 ){
 		return -E_BAD_ENV;
 	}
@@ -362,35 +610,67 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 		if ( (uint32_t)perm & ~PTE_SYSCALL ){
 			return -E_INVAL;
 		}
-		pte_t *pentry;
-		page_lookup(curenv->env_pgdir, srcva, &pentry);
-		if ( !(*pentry & PTE_P) ){
+		if ( !page_lookup(curenv->env_pgdir, srcva, NULL) ){
+			page_demand(curenv, srcva, 0, 1);
+		}
+		pinfo = page_lookup(curenv->env_pgdir, srcva, &pentry);
+		if ( !pinfo ){
 			return -E_INVAL;
 		}
 		if ( (perm & PTE_W) && !(*pentry & PTE_W) ){
 			return -E_INVAL;
 		}
-		if ( (uint32_t)env_store->env_ipc_dstva < UTOP ){
-			struct PageInfo *pinfo = page_lookup(curenv->env_pgdir, srcva, NULL);
-			if ( !pinfo ){
-				return -E_NO_MEM;
-			}
-			if ( page_insert(env_store->env_pgdir, pinfo, env_store->env_ipc_dstva, perm|PTE_U ) < 0 ){
-				return -E_NO_MEM;
-			}
-			ispg = 1;
-		}
 	}
-	env_store->env_ipc_recving = 0;
-	env_store->env_ipc_from = curenv->env_id;
-	env_store->env_ipc_value = value;
-	env_store->env_ipc_perm = (ispg ? (perm|PTE_P|PTE_U) : 0);
-	env_store->env_tf.tf_regs.reg_eax = 0;
-	env_store->env_status = ENV_RUNNABLE;
-	return 0;
+	return ipc_deliver(env_store, curenv->env_id, value, pinfo, perm);
 	//panic("sys_ipc_try_send not implemented");
 }
 
+// Answer envid's page-in request (see kern/pager.c) with value and the
+// page at srcva, if srcva < UTOP.  Only envid's pager can answer, and
+// only once the request has been delivered to it; sys_ipc_try_send
+// never does.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//	-E_INVAL if envid is not waiting for a page-in from us.
+//	-E_INVAL if srcva < UTOP but srcva is not page-aligned or not
+//		mapped in the caller's address space.
+static int
+sys_pagein_reply(envid_t envid, int32_t value, void *srcva)
+{
+	struct Env *e;
+	struct PageInfo *pp = NULL;
+
+	if (envid2env(envid, &e, 0) < 0)
+		return -E_BAD_ENV;
+	if (e->env_pagein != PAGEIN_SENT || e->env_pager != curenv->env_id)
+		return -E_INVAL;
+	if ((uintptr_t) srcva < UTOP) {
+		if ((uintptr_t) srcva % PGSIZE)
+			return -E_INVAL;
+		if (!page_lookup(curenv->env_pgdir, srcva, NULL))
+			page_demand(curenv, srcva, 0, 1);
+		if (!(pp = page_lookup(curenv->env_pgdir, srcva, NULL)))
+			return -E_INVAL;
+	}
+	pagein_finish(e, value, pp);
+	return 0;
+}
+
+// Environments listening for each hardware interrupt (see sys_irq_listen).
+static envid_t irq_listener[16];
+
+// Lowest IRQ set in mask, which must be nonzero.
+static int
+ffs_irq(uint32_t mask)
+{
+	int irq;
+
+	for (irq = 0; !(mask & (1 << irq)); irq++)
+		/* keep looking */;
+	return irq;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -405,18 +685,67 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 static int
 sys_ipc_recv(void *dstva)
 {
+	int irq;
+
 	// LAB 4: Your code here.
 	if ( (uint32_t)dstva < UTOP && ((uint32_t)dstva % PGSIZE) ){
 		return -E_INVAL;
 	}
+	if (curenv->env_irq_pending) {
+		// Deliver an interrupt that came while we were busy
+		irq = ffs_irq(curenv->env_irq_pending);
+		curenv->env_irq_pending &= ~(1 << irq);
+		curenv->env_ipc_from = 0;
+		curenv->env_ipc_value = irq;
+		curenv->env_ipc_perm = 0;
+		return 0;
+	}
 	curenv->env_ipc_recving = 1;
 	curenv->env_ipc_dstva = dstva;
 	curenv->env_status = ENV_NOT_RUNNABLE;
+	// Take a page-in request queued while we were busy (see pagein)
+	pagein_deliver(curenv);
 	sched_yield();
 	//panic("sys_ipc_recv not implemented");
 	return 0;
 }
 
+// Ask for an IPC from envid 0, with value irq, each time hardware
+// interrupt irq fires.  If the environment is not receiving then, the
+// IPC is delivered by its next sys_ipc_recv; interrupts that fire again
+// before that are merged.  Each IRQ has at most one listener, and only
+// environments with I/O privilege may listen, since they must talk to
+// the device to quiet it.  For now that means the file server and the
+// IDE interrupt.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if irq is not IRQ_IDE, or curenv lacks I/O privilege.
+static int
+sys_irq_listen(int irq)
+{
+	if (irq != IRQ_IDE)
+		return -E_INVAL;
+	if ((curenv->env_tf.tf_eflags & FL_IOPL_MASK) != FL_IOPL_3)
+		return -E_INVAL;
+	irq_listener[irq] = curenv->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Called from the trap handler when irq fires.
+void
+irq_notify(int irq)
+{
+	struct Env *e;
+
+	if (!irq_listener[irq] || envid2env(irq_listener[irq], &e, 0) < 0)
+		return;
+	if (e->env_ipc_recving)
+		ipc_deliver(e, 0, irq, NULL, 0);
+	else
+		e->env_irq_pending |= 1 << irq;
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -426,16 +755,24 @@ sys_time_msec(void)
 	//panic("sys_time_msec not implemented");
 }
 
+// The driver copies the packet in or out with copyin or copyout, which
+// check the buffer as they go.
 static int
 sys_ether_try_send(void* buf_to_trans, size_t sz){
-	user_mem_assert(curenv, buf_to_trans, sz, PTE_U);
-	return e1000_transmit(buf_to_trans, sz);
+	int r = e1000_transmit(buf_to_trans, sz);
+	if ( r == -E_FAULT ){
+		user_mem_fault(curenv);
+	}
+	return r;
 }
 
 static int
 sys_ether_try_recv(void* buf_to_recv, size_t sz){
-	user_mem_assert(curenv, buf_to_recv, sz, PTE_U|PTE_W);
-	return e1000_receive(buf_to_recv, sz);
+	int r = e1000_receive(buf_to_recv, sz);
+	if ( r == -E_FAULT ){
+		user_mem_fault(curenv);
+	}
+	return r;
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
@@ -485,6 +822,16 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_ether_try_send((void*)a1, a2);
 	case SYS_ether_try_recv:
 		return sys_ether_try_recv((void*)a1, a2);
+	case SYS_irq_listen:
+		return sys_irq_listen(a1);
+	case SYS_fork_cow:
+		return sys_fork_cow();
+	case SYS_page_map_range:
+		return sys_page_map_range((const struct PageMap *) a1, a2);
+	case SYS_env_set_pager:
+		return sys_env_set_pager(a1, a2, a3, (void *) a4);
+	case SYS_pagein_reply:
+		return sys_pagein_reply(a1, a2, (void *) a3);
 	default:
 		return -E_INVAL;
 	}
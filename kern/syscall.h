@@ -5,7 +5,10 @@
 #endif
 
 #include <inc/syscall.h>
+#include <inc/env.h>
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+void irq_notify(int irq);
+int ipc_deliver(struct Env *e, envid_t from, uint32_t value, struct PageInfo *pp, int perm);
 
 #endif /* !JOS_KERN_SYSCALL_H */
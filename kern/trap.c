@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/pager.h>
 
 static struct Taskstate ts;
 
@@ -301,6 +302,9 @@ trap_dispatch(struct Trapframe *tf)
 	case IRQ_OFFSET + IRQ_SERIAL:
 		serial_intr();
 		return;
+	case IRQ_OFFSET + IRQ_IDE:
+		irq_notify(IRQ_IDE);
+		return;
 	}
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
@@ -401,17 +405,63 @@ trap(struct Trapframe *tf)
 }
 
 
+// The exception table (see kern/copy.S): kernel instructions that may
+// fault on user memory, and where to resume when they do.
+struct ExTable {
+	uintptr_t ex_eip;
+	uintptr_t ex_fixup;
+};
+
+extern const struct ExTable __EX_TABLE_BEGIN__[];
+extern const struct ExTable __EX_TABLE_END__[];
+
+// Return the fixup for a fault at kernel address eip, or 0 if there is none.
+static uintptr_t
+ex_table_fixup(uintptr_t eip)
+{
+	const struct ExTable *ex;
+
+	for (ex = __EX_TABLE_BEGIN__; ex < __EX_TABLE_END__; ex++)
+		if (ex->ex_eip == eip)
+			return ex->ex_fixup;
+	return 0;
+}
+
 void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
+	uintptr_t fixup;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
+	fixup = (tf->tf_cs & 3) == 0 ? ex_table_fixup(tf->tf_eip) : 0;
+
+	// Writes to copy-on-write pages and touches of pages not filled
+	// in yet, by the environment or by the kernel on its behalf, are
+	// resolved here without a round trip through the environment's
+	// page fault upcall.  Paging in from a file blocks the
+	// environment, so the kernel itself can wait for that only in
+	// copyin and copyout, where the system call can start over.
+	if (curenv && page_demand(curenv, (void *) fault_va,
+				  tf->tf_err & FEC_WR ? PTE_W : 0,
+				  (tf->tf_cs & 3) == 3 || fixup) == 0) {
+		// A kernel-mode fault goes straight back to the faulting
+		// kernel code rather than to curenv.
+		if ((tf->tf_cs & 3) == 0)
+			env_pop_tf(tf);
+		return;
+	}
+
+	// A bad user address in copyin or copyout makes it fail.
+	if (fixup) {
+		tf->tf_eip = fixup;
+		env_pop_tf(tf);
+	}
 
 	// Handle kernel-mode page faults.
 	if ( (tf->tf_cs & 3) == 0 ){
-		struct PageInfo *p = page_alloc(0);
+		struct PageInfo *p = page_alloc(ALLOC_HIGH);
 		if ( !p ){
 			panic("page_fault_handler: page_alloc failed\n");
 		}
@@ -7,28 +7,129 @@
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in buf, and parts of the
+// response may be written back to buf.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_buf(union Fsipc *buf, unsigned type, void *dstva)
 {
 	static envid_t fsenv;
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
-	static_assert(sizeof(fsipcbuf) == PGSIZE);
+	static_assert(sizeof(*buf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)buf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	ipc_send(fsenv, type, buf, PTE_P | PTE_W | PTE_U);
 	return ipc_recv(NULL, dstva, NULL);
 }
 
-static int devfile_flush(struct Fd *fd);
+// Send a request built in fsipcbuf.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	return fsipc_buf(&fsipcbuf, type, dstva);
+}
+
+// This environment's transfer window (see FSREQ_WINDOW), just below
+// the fd table.  The pages are PTE_SHARE so that fork leaves the
+// parent's registered pages in place instead of making them
+// copy-on-write; a child notices it does not own them and registers
+// fresh ones.
+#define FSWINDOW	((char *) 0xD0000000 - FSWINDOW_SIZE)
+
+// Make sure this environment's window is registered with the server.
+// Returns 0 on success, < 0 on error.
+static int
+fswindow_setup(void)
+{
+	static envid_t owner;
+	union Fsipc *pg;
+	int i, r;
+
+	if (owner == thisenv->env_id)
+		return 0;
+	for (i = 0; i < FSWINDOW_PAGES; i++) {
+		pg = (union Fsipc *) (FSWINDOW + i * PGSIZE);
+		if ((r = sys_page_alloc(0, pg, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			return r;
+		pg->window.req_index = i;
+		if ((r = fsipc_buf(pg, FSREQ_WINDOW, NULL)) < 0)
+			return r;
+	}
+	owner = thisenv->env_id;
+	return 0;
+}
+
+// Cache of file pages for small reads on read-only opens, so that
+// reading a file a line or a byte at a time costs no IPC.  The pages
+// are the file server's own block-cache pages, mapped with FSREQ_MAP.
+// An entry is good while the file's generation, which the server
+// publishes in the Fd page, is the one it was filled under; the size
+// published there bounds reads.
+#define FCACHE_PAGES	32
+#define FCACHE		(FSWINDOW - FCACHE_PAGES * PGSIZE)
+
+struct Fcache {
+	int fc_fileid;		// 0 if the slot is empty
+	uint32_t fc_gen;	// fd_file.gen when the page was mapped
+	uint32_t fc_pageno;	// page of the file
+};
+
+static struct Fcache fcache[FCACHE_PAGES];
+
+// Find page pageno of fd in the cache, mapping it there on a miss.
+// Returns 0 and sets *pg on success, < 0 on error.
+static int
+fcache_page(struct Fd *fd, uint32_t pageno, char **pg)
+{
+	uint32_t slot = (fd->fd_file.id * 31 + pageno) % FCACHE_PAGES;
+	uint32_t gen = fd->fd_file.gen;
+	struct Fcache *c = &fcache[slot];
+	int r;
+
+	*pg = FCACHE + slot * PGSIZE;
+	if (c->fc_fileid == fd->fd_file.id && c->fc_gen == gen
+	    && c->fc_pageno == pageno)
+		return 0;
+
+	c->fc_fileid = 0;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = pageno * PGSIZE;
+	if ((r = fsipc(FSREQ_MAP, *pg)) < 0)
+		return r;
+	c->fc_fileid = fd->fd_file.id;
+	c->fc_gen = gen;
+	c->fc_pageno = pageno;
+	return 0;
+}
+
+// Read at most n bytes from fd's cached pages, advancing the offset.
+// The offset must be before the end of the file.
+static ssize_t
+devfile_read_cached(struct Fd *fd, void *buf, size_t n)
+{
+	off_t off = fd->fd_offset;
+	size_t done, m;
+	char *pg;
+	int r;
+
+	n = MIN(n, fd->fd_file.size - off);
+	for (done = 0; done < n; done += m) {
+		if ((r = fcache_page(fd, (off + done) / PGSIZE, &pg)) < 0)
+			return r;
+		m = MIN(n - done, PGSIZE - PGOFF(off + done));
+		memmove(buf + done, pg + PGOFF(off + done), m);
+	}
+	fd->fd_offset = off + done;
+	return done;
+}
+
+static int devfile_close(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
@@ -39,7 +140,7 @@ struct Dev devfile =
 	.dev_id =	'f',
 	.dev_name =	"file",
 	.dev_read =	devfile_read,
-	.dev_close =	devfile_flush,
+	.dev_close =	devfile_close,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
 	.dev_trunc =	devfile_trunc
@@ -88,19 +189,18 @@ open(const char *path, int mode)
 	return fd2num(fd);
 }
 
-// Flush the file descriptor.  After this the fileid is invalid.
+// Close the file descriptor.  After this the fileid is invalid.
 //
 // This function is called by fd_close.  fd_close will take care of
-// unmapping the FD page from this environment.  Since the server uses
-// the reference counts on the FD pages to detect which files are
-// open, unmapping it is enough to free up server-side resources.
-// Other than that, we just have to make sure our changes are flushed
-// to disk.
+// unmapping the FD page from this environment.  The server flushes our
+// changes to disk and, if no one else shares the FD page, frees the
+// open file right away.  (It would also notice from the FD page's
+// reference count once we unmap it, but only when it runs short.)
 static int
-devfile_flush(struct Fd *fd)
+devfile_close(struct Fd *fd)
 {
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	return fsipc(FSREQ_CLOSE, NULL);
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -114,9 +214,28 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// Make an FSREQ_READ request to the file system server after
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
-	// system server.
+	// system server.  Reads of more than a page go through the
+	// window instead, FSWINDOW_SIZE bytes per request, and small
+	// reads of read-only files are served from the page cache.
 	int r;
 
+	// (End of file still goes to the server, which also notices if
+	// fd has been closed.)
+	if ((fd->fd_omode & O_ACCMODE) == O_RDONLY && fd->fd_file.type == FTYPE_REG
+	    && n <= PGSIZE && fd->fd_offset < fd->fd_file.size
+	    && (r = devfile_read_cached(fd, buf, n)) >= 0)
+		return r;
+
+	if (n > sizeof(fsipcbuf.readRet.ret_buf) && fswindow_setup() == 0) {
+		fsipcbuf.winio.req_fileid = fd->fd_file.id;
+		fsipcbuf.winio.req_n = MIN(n, FSWINDOW_SIZE);
+		if ((r = fsipc(FSREQ_READ_WINDOW, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		memmove(buf, FSWINDOW, r);
+		return r;
+	}
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -140,8 +259,19 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// careful: fsipcbuf.write.req_buf is only so large, but
 	// remember that write is always allowed to write *fewer*
 	// bytes than requested.
+	// Writes of more than that go through the window.
 	// LAB 5: Your code here
 	int r;
+
+	if (n > sizeof(fsipcbuf.write.req_buf) && fswindow_setup() == 0) {
+		n = MIN(n, FSWINDOW_SIZE);
+		memmove(FSWINDOW, buf, n);
+		fsipcbuf.winio.req_fileid = fd->fd_file.id;
+		fsipcbuf.winio.req_n = n;
+		return fsipc(FSREQ_WRITE_WINDOW, NULL);
+	}
+
+	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 	memmove(fsipcbuf.write.req_buf, buf, n);
@@ -173,6 +303,16 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// Remove a file or an empty directory
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -183,3 +323,227 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Ask the file server to write back and then evict its whole block
+// cache, so that later reads start cold
+int
+fsdropcache(void)
+{
+	return fsipc(FSREQ_DROP_CACHE, NULL);
+}
+
+// Give the bytes [offset, offset+len) of file fdnum disk blocks now,
+// rather than as they are written, extending the file if needed.
+// The blocks are placed contiguously when there is room.  Holes in the
+// range read as zeros, as before.
+int
+fallocate(int fdnum, off_t offset, off_t len)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	fsipcbuf.fallocate.req_fileid = fd->fd_file.id;
+	fsipcbuf.fallocate.req_offset = offset;
+	fsipcbuf.fallocate.req_len = len;
+	return fsipc(FSREQ_FALLOCATE, NULL);
+}
+
+// Fetch the file server's statistics
+int
+fsstat(struct Fsstat *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_FSSTAT, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.fsstatRet;
+	return 0;
+}
+
+// Create a snapshot of the file system called name, readable under
+// /.snap/name.
+int
+snapshot(const char *name)
+{
+	if (strlen(name) >= MAXNAMELEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.snapshot.req_name, name);
+	fsipcbuf.snapshot.req_delete = 0;
+	return fsipc(FSREQ_SNAPSHOT, NULL);
+}
+
+// Delete the snapshot called name.
+int
+snapshot_delete(const char *name)
+{
+	if (strlen(name) >= MAXNAMELEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.snapshot.req_name, name);
+	fsipcbuf.snapshot.req_delete = 1;
+	return fsipc(FSREQ_SNAPSHOT, NULL);
+}
+
+// Fetch up to n of the file server's trace events, starting with event
+// number *pos, into ents.  Sets *pos to the number of ents[0], which is
+// later than asked for if older events were lost.  Returns the number
+// of events fetched; 0 means there are no more yet.
+int
+fstrace(uint32_t *pos, struct Fstrace *ents, int n)
+{
+	int r;
+
+	fsipcbuf.trace.req_pos = *pos;
+	if ((r = fsipc(FSREQ_TRACE, NULL)) < 0)
+		return r;
+	r = MIN(r, n);
+	*pos = fsipcbuf.traceRet.ret_pos;
+	memmove(ents, fsipcbuf.traceRet.ret_ents, r * sizeof(struct Fstrace));
+	return r;
+}
+
+
+// Map the page of file fdnum at byte offset (a multiple of PGSIZE)
+// read-only at dstva.  The page is the file server's block-cache page,
+// shared rather than copied, so it reflects later writes to the file,
+// except that a page in a hole is a zero page that stays zero.
+// Bytes past the end of the file in the last page are unspecified.
+int
+read_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id || PGOFF(offset))
+		return -E_INVAL;
+	fsipcbuf.map.req_fileid = fd->fd_file.id;
+	fsipcbuf.map.req_offset = offset;
+	return fsipc(FSREQ_MAP, dstva);
+}
+
+// Memory-mapped files.  mmap only records the region; mmap_pgfault maps
+// each page on first touch with an FSREQ_MAP request.  Read-only regions
+// share the file server's pages.  Writable regions are private: a write
+// replaces the shared page with a copy, and nothing is written back.
+// The file must stay open while it is mapped.  System calls cannot fault
+// pages in, so touch a mapped buffer before handing it to one.
+
+#define MAXMMAP		16
+
+struct Mmap {
+	uintptr_t mm_va;	// first page; 0 if the slot is free
+	uintptr_t mm_end;	// end of the region, page aligned
+	int mm_prot;		// PROT_READ, maybe PROT_WRITE
+	int mm_fdnum;		// backing file
+	off_t mm_offset;	// file offset of mm_va
+};
+
+static struct Mmap mmaps[MAXMMAP];
+
+// Request page for mmap_pgfault, which may run while fsipcbuf holds a
+// half-built request (say, write() from a mapped buffer).
+static union Fsipc mmapipcbuf __attribute__((aligned(PGSIZE)));
+
+static int
+mmap_pgfault(struct UTrapframe *utf)
+{
+	uintptr_t va = ROUNDDOWN(utf->utf_fault_va, PGSIZE);
+	struct Mmap *m;
+	struct Fd *fd;
+	int r;
+
+	for (m = mmaps; m < mmaps + MAXMMAP; m++)
+		if (m->mm_va && m->mm_va <= va && va < m->mm_end)
+			break;
+	if (m == mmaps + MAXMMAP)
+		return 0;
+	if ((utf->utf_err & FEC_WR) && !(m->mm_prot & PROT_WRITE))
+		return 0;
+
+	if (!(utf->utf_err & FEC_PR)) {
+		if ((r = fd_lookup(m->mm_fdnum, &fd)) < 0)
+			panic("mmap_pgfault: fd %d: %e", m->mm_fdnum, r);
+		mmapipcbuf.map.req_fileid = fd->fd_file.id;
+		mmapipcbuf.map.req_offset = m->mm_offset + (va - m->mm_va);
+		if ((r = fsipc_buf(&mmapipcbuf, FSREQ_MAP, (void *) va)) < 0)
+			panic("mmap_pgfault: va %08x: %e", va, r);
+		if (!(utf->utf_err & FEC_WR))
+			return 1;
+	}
+
+	// First write to a private page: copy the shared one
+	if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("mmap_pgfault: %e", r);
+	memmove(PFTEMP, (void *) va, PGSIZE);
+	if ((r = sys_page_map(0, PFTEMP, 0, (void *) va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("mmap_pgfault: %e", r);
+	sys_page_unmap(0, PFTEMP);
+	return 1;
+}
+
+// Map len bytes of file fdnum, starting at byte offset, at va, which
+// must not already be mapped.  va and offset must be page aligned, and
+// prot is PROT_READ, or PROT_READ|PROT_WRITE for a private copy.
+// Returns 0 on success, < 0 on error.
+int
+mmap(void *va, size_t len, int prot, int fdnum, off_t offset)
+{
+	uintptr_t start = (uintptr_t) va, end = start + ROUNDUP(len, PGSIZE);
+	struct Mmap *m, *slot = 0;
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id
+	    || (fd->fd_omode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (PGOFF(start) || PGOFF(offset) || offset < 0 || !(prot & PROT_READ)
+	    || start == 0 || end <= start || end > UTOP)
+		return -E_INVAL;
+
+	for (m = mmaps; m < mmaps + MAXMMAP; m++) {
+		if (!m->mm_va)
+			slot = slot ? slot : m;
+		else if (start < m->mm_end && m->mm_va < end)
+			return -E_INVAL;
+	}
+	if (!slot)
+		return -E_NO_MEM;
+
+	add_pgfault_hook(mmap_pgfault);
+	slot->mm_va = start;
+	slot->mm_end = end;
+	slot->mm_prot = prot;
+	slot->mm_fdnum = fdnum;
+	slot->mm_offset = offset;
+	return 0;
+}
+
+// Unmap every region inside [va, va+len).  Regions that are only
+// partly inside are left alone and make munmap fail with -E_INVAL.
+int
+munmap(void *va, size_t len)
+{
+	uintptr_t start = (uintptr_t) va, end = start + ROUNDUP(len, PGSIZE);
+	uintptr_t p;
+	struct Mmap *m;
+
+	for (m = mmaps; m < mmaps + MAXMMAP; m++)
+		if (m->mm_va && start < m->mm_end && m->mm_va < end
+		    && (m->mm_va < start || m->mm_end > end))
+			return -E_INVAL;
+
+	for (m = mmaps; m < mmaps + MAXMMAP; m++) {
+		if (!m->mm_va || m->mm_va < start || m->mm_end > end)
+			continue;
+		for (p = m->mm_va; p < m->mm_end; p += PGSIZE)
+			sys_page_unmap(0, (void *) p);
+		m->mm_va = 0;
+	}
+	return 0;
+}
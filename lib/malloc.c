@@ -41,10 +41,11 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	int npages;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
+	struct PageMap pm[2];
 
 	if (mptr == 0)
 		mptr = mbegin;
@@ -94,17 +95,23 @@ malloc(size_t n)
 
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * every page but the last is PTE_CONTINUED; one system call
+	 * allocates them all.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	npages = ROUNDUP(n + 4, PGSIZE) / PGSIZE;
+	pm[0] = (struct PageMap) { PM_ALLOC, 0, 0, 0, (uintptr_t) mptr,
+				   PTE_P|PTE_U|PTE_W|PTE_CONTINUED, npages - 1 };
+	pm[1] = (struct PageMap) { PM_ALLOC, 0, 0, 0,
+				   (uintptr_t) mptr + (npages - 1) * PGSIZE,
+				   PTE_P|PTE_U|PTE_W, 1 };
+	if (sys_page_map_range(pm, 2) < 0) {
+		pm[0] = (struct PageMap) { PM_UNMAP, 0, 0, 0, (uintptr_t) mptr,
+					   0, npages };
+		sys_page_map_range(pm, 1);
+		return 0;	/* out of physical memory */
 	}
 
-	ref = (uint32_t*) (mptr + i - 4);
+	ref = (uint32_t*) (mptr + npages * PGSIZE - 4);
 	*ref = 2;	/* reference for mptr, reference for returned block */
 	v = mptr;
 	mptr += n;
@@ -116,6 +123,8 @@ free(void *v)
 {
 	uint8_t *c;
 	uint32_t *ref;
+	struct PageMap pm;
+	int n;
 
 	if (v == 0)
 		return;
@@ -123,10 +132,12 @@ free(void *v)
 
 	c = ROUNDDOWN(v, PGSIZE);
 
-	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	for (n = 0; uvpt[PGNUM(c + n * PGSIZE)] & PTE_CONTINUED; n++)
+		assert(mbegin <= c + (n + 1) * PGSIZE && c + (n + 1) * PGSIZE < mend);
+	if (n) {
+		pm = (struct PageMap) { PM_UNMAP, 0, 0, 0, (uintptr_t) c, 0, n };
+		sys_page_map_range(&pm, 1);
+		c += n * PGSIZE;
 	}
 
 	/*
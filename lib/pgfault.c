@@ -11,30 +11,80 @@
 extern void _pgfault_upcall(void);
 
 // Pointer to currently installed C-language pgfault handler.
+// Once anything is registered this is always pgfault_dispatch.
 void (*_pgfault_handler)(struct UTrapframe *utf);
 
-//
-// Set the page fault handler function.
-// If there isn't one yet, _pgfault_handler will be 0.
+#define MAXPGFAULTHOOK	4
+
+// Hooks that get the first look at every fault, in registration order
+// (e.g. to page in memory-mapped files).  Each returns 1 if it resolved
+// the fault, or 0 to pass it on.
+static int (*pgfault_hooks[MAXPGFAULTHOOK])(struct UTrapframe *utf);
+static int npgfault_hooks;
+
+// The handler installed by set_pgfault_handler, tried after the hooks.
+static void (*pgfault_handler)(struct UTrapframe *utf);
+
+static void
+pgfault_dispatch(struct UTrapframe *utf)
+{
+	int i;
+
+	for (i = 0; i < npgfault_hooks; i++)
+		if (pgfault_hooks[i](utf))
+			return;
+	if (!pgfault_handler)
+		panic("unhandled page fault va %08x ip %08x err %x",
+		      utf->utf_fault_va, utf->utf_eip, utf->utf_err);
+	pgfault_handler(utf);
+}
+
 // The first time we register a handler, we need to
 // allocate an exception stack (one page of memory with its top
 // at UXSTACKTOP), and tell the kernel to call the assembly-language
 // _pgfault_upcall routine when a page fault occurs.
+static void
+pgfault_init(void)
+{
+	int r;
+
+	if (_pgfault_handler)
+		return;
+	r = sys_page_alloc(sys_getenvid(), (void*)(UXSTACKTOP - PGSIZE), PTE_W|PTE_U);
+	if ( r < 0 ){
+		panic("pgfault_init: %e\n", r);
+	}
+	sys_env_set_pgfault_upcall(sys_getenvid(), _pgfault_upcall);
+	_pgfault_handler = pgfault_dispatch;
+}
+
+//
+// Set the page fault handler function.
+// It sees every fault that no hook added with add_pgfault_hook
+// resolved.
 //
 void
 set_pgfault_handler(void (*handler)(struct UTrapframe *utf))
 {
-	int r;
+	pgfault_init();
 
-	if (_pgfault_handler == 0) {
-		r = sys_page_alloc(sys_getenvid(), (void*)(UXSTACKTOP - PGSIZE), PTE_W|PTE_U);
-		if ( r < 0 ){
-			panic("set_pgfault_handler: %e\n", r);
-		}
-		sys_env_set_pgfault_upcall(sys_getenvid(), _pgfault_upcall);
-		//panic("set_pgfault_handler not implemented");
-	}
+	// Save handler pointer for pgfault_dispatch to call.
+	pgfault_handler = handler;
+}
+
+//
+// Add a hook to try before the page fault handler.
+//
+void
+add_pgfault_hook(int (*hook)(struct UTrapframe *utf))
+{
+	int i;
 
-	// Save handler pointer for assembly to call.
-	_pgfault_handler = handler;
+	pgfault_init();
+	for (i = 0; i < npgfault_hooks; i++)
+		if (pgfault_hooks[i] == hook)
+			return;
+	if (npgfault_hooks == MAXPGFAULTHOOK)
+		panic("add_pgfault_hook: too many hooks");
+	pgfault_hooks[npgfault_hooks++] = hook;
 }
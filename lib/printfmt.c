@@ -38,6 +38,8 @@ static const char * const error_string[MAXERROR] =
 	
 	[E_FULL_BUF]	= "network buffer full",
 	[E_NO_RECV]	= "nothing to receive now",
+	[E_NOT_EMPTY]	= "directory not empty",
+	[E_BUSY]	= "resource is in use",
 };
 
 /*
@@ -5,10 +5,21 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Batch size for sys_page_map_range: map_segment stages this many pages
+// at UTEMP at a time, and copy_shared_pages sends this many requests.
+#define NSTAGE			64
+
+// The child's pager state (see setup_pager), below the file cache in
+// lib/file.c.
+#define PAGERFD			((void *) 0xCFFCE000)
+#define PAGERREQ		((void *) 0xCFFCF000)
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
-		       int fd, size_t filesz, off_t fileoffset, int perm);
+		       int fd, size_t filesz, off_t fileoffset, int perm,
+		       bool lazy);
+static int setup_pager(envid_t child, int fd);
 static int copy_shared_pages(envid_t child);
 
 // Spawn a child process from a program image loaded from the file system.
@@ -27,6 +38,7 @@ spawn(const char *prog, const char **argv)
 	struct Elf *elf;
 	struct Proghdr *ph;
 	int perm;
+	bool lazy;
 
 	// This code follows this procedure:
 	//
@@ -54,8 +66,8 @@ spawn(const char *prog, const char **argv)
 	//        so that multiple instances of the same program
 	//	  will share the same copy of the program text.
 	//        Be sure to map the program text read-only in the child.
-	//        Read_map is like read but returns a pointer to the data in
-	//        *blk rather than copying the data into another buffer.
+	//        Read_map is like read but maps the file server's own page
+	//        for that part of the file rather than copying the data.
 	//
 	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
 	//	  then the segment contains read/write data and bss.
@@ -110,6 +122,11 @@ spawn(const char *prog, const char **argv)
 	if ((r = init_stack(child, argv, &child_tf.tf_esp)) < 0)
 		return r;
 
+	// Load the program on demand if the file server can page it in.
+	if ((r = setup_pager(child, fd)) < 0)
+		goto error;
+	lazy = r;
+
 	// Set up program segments as defined in ELF header.
 	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
@@ -119,7 +136,8 @@ spawn(const char *prog, const char **argv)
 		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
 			perm |= PTE_W;
 		if ((r = map_segment(child, ph->p_va, ph->p_memsz,
-				     fd, ph->p_filesz, ph->p_offset, perm)) < 0)
+				     fd, ph->p_filesz, ph->p_offset, perm,
+				     lazy && PGOFF(ph->p_offset) == PGOFF(ph->p_va))) < 0)
 			goto error;
 	}
 	close(fd);
@@ -248,9 +266,12 @@ init_stack(envid_t child, const char **argv, uintptr_t *init_esp)
 
 	// After completing the stack, map it into the child's address space
 	// and unmap it from ours!
-	if ((r = sys_page_map(0, UTEMP, child, (void*) (USTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W)) < 0)
-		goto error;
-	if ((r = sys_page_unmap(0, UTEMP)) < 0)
+	struct PageMap pm[2] = {
+		{ PM_MAP, 0, (uintptr_t) UTEMP, child, USTACKTOP - PGSIZE,
+		  PTE_P | PTE_U | PTE_W, 1 },
+		{ PM_UNMAP, 0, 0, 0, (uintptr_t) UTEMP, 0, 1 },
+	};
+	if ((r = sys_page_map_range(pm, 2)) < 0)
 		goto error;
 
 	return 0;
@@ -260,12 +281,59 @@ error:
 	return r;
 }
 
+// Stage the page at offset off of the segment at va.
+static int
+stage_page(void *va, size_t memsz, int fd, size_t filesz, off_t fileoffset,
+	   size_t off, int perm)
+{
+	int r;
+
+	if (!(perm & PTE_W) && (off + PGSIZE <= filesz || memsz == filesz))
+		// Text and read-only data: share the file server's
+		// block-cache page instead of copying it
+		return read_map(fd, fileoffset + off, va);
+
+	// from file
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	if ((r = seek(fd, fileoffset + off)) < 0)
+		return r;
+	// the page is zeroed, so any bss in it is already clear
+	if ((r = readn(fd, va, MIN(PGSIZE, filesz - off))) < 0)
+		return r;
+	return 0;
+}
+
+// Send the requests in pm[0..*npm) and unmap the *nstaged pages staged
+// at UTEMP.
+static int
+flush_segment(struct PageMap *pm, int *npm, int *nstaged)
+{
+	int r;
+
+	if (*nstaged)
+		pm[(*npm)++] = (struct PageMap) { PM_UNMAP, 0, 0, 0,
+						  (uintptr_t) UTEMP, 0, *nstaged };
+	r = sys_page_map_range(pm, *npm);
+	*npm = *nstaged = 0;
+	return r;
+}
+
+// Map a program segment into the child.  With a pager (lazy set), pages
+// wholly backed by the file are left for the kernel to page in from the
+// file server on first touch, and the bss is left demand-zero; only a
+// page that mixes file data and bss is loaded now.  Without one, the
+// pages backed by the file are staged at UTEMP, NSTAGE at a time, and
+// the bss is allocated.  Runs of pages handled the same way become
+// single sys_page_map_range requests.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
-	int fd, size_t filesz, off_t fileoffset, int perm)
+	int fd, size_t filesz, off_t fileoffset, int perm, bool lazy)
 {
-	int i, r;
-	void *blk;
+	struct PageMap pm[NSTAGE + 1], *last;
+	uintptr_t src;
+	size_t i;
+	int npm = 0, nstaged = 0, op, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -278,59 +346,108 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// the original code here is seriouly buggy...
-			// it does not set bss to zero...
-			// allocate a blank page
-			//if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-			//	return r;
-			if ( (r = sys_page_alloc(0, (void*)PFTEMP, PTE_W)) < 0 ){
-				return r;
-			}
-			memset((void*)PFTEMP, 0, PGSIZE);
-			if ( (r = sys_page_map(0, (void*)PFTEMP, child, (void*)(va + i), perm)) < 0 ){
-				goto fail;
-			}
+			op = lazy ? PM_ZERO : PM_ALLOC;
+			src = 0;
+		} else if (lazy && (i + PGSIZE <= filesz || memsz == filesz)) {
+			op = PM_FILE;
+			src = fileoffset + i;
 		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			src = (uintptr_t) UTEMP + nstaged * PGSIZE;
+			if ((r = stage_page((void *) src, memsz, fd, filesz,
+					    fileoffset, i, perm)) < 0) {
+				pm[0] = (struct PageMap) { PM_UNMAP, 0, 0, 0,
+					(uintptr_t) UTEMP, 0, nstaged + 1 };
+				sys_page_map_range(pm, 1);
 				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ( i + PGSIZE >= filesz && i + PGSIZE < memsz ){
-			// in case of a bss...
-				memset((void*)(UTEMP + filesz - i), 0, PGSIZE - (filesz - i));
 			}
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			op = PM_MAP;
+			nstaged++;
 		}
+
+		last = &pm[npm - 1];
+		if (npm && last->pm_op == op
+		    && last->pm_dstva + last->pm_npages * PGSIZE == va + i
+		    && (src == 0 || last->pm_srcva + last->pm_npages * PGSIZE == src))
+			last->pm_npages++;
+		else
+			pm[npm++] = (struct PageMap) { op, 0, src, child, va + i,
+						       perm, 1 };
+		if ((npm == NSTAGE || nstaged == NSTAGE)
+		    && (r = flush_segment(pm, &npm, &nstaged)) < 0)
+			return r;
 	}
+	if (npm && (r = flush_segment(pm, &npm, &nstaged)) < 0)
+		return r;
 	return 0;
-fail:
-	sys_page_unmap(0, (void*)PFTEMP);
-	return r;
 }
 
-// Copy the mappings for shared pages into the child address space.
+// Make the file server the child's pager for the program file fd: give
+// the child its own mapping of fd's Fd page at PAGERFD, which keeps the
+// file open for as long as the child lives, and a request page at
+// PAGERREQ for the kernel to send page-in requests from.  Returns 1 if
+// the child has a pager, 0 if fd is not a file-server file, < 0 on error.
 static int
-copy_shared_pages(envid_t child)
+setup_pager(envid_t child, int fd)
 {
-	// LAB 5: Your code here.
-	int pn = USTABDATA / PGSIZE;
+	struct Fd *f;
+	envid_t fsenv;
 	int r;
-	while( pn < USTACKTOP / PGSIZE ){
-		if ( !(uvpd[pn >> 10] & PTE_P) ){
-			pn = ROUNDDOWN(pn, 1<<10) + (1<<10);
+
+	if ((r = fd_lookup(fd, &f)) < 0)
+		return r;
+	if (f->fd_dev_id != devfile.dev_id
+	    || !(fsenv = ipc_find_env(ENV_TYPE_FS)))
+		return 0;
+
+	struct PageMap pm[2] = {
+		{ PM_MAP, 0, (uintptr_t) f, child, (uintptr_t) PAGERFD,
+		  PTE_P | PTE_U | PTE_SHARE, 1 },
+		{ PM_ALLOC, 0, 0, child, (uintptr_t) PAGERREQ,
+		  PTE_P | PTE_U | PTE_W, 1 },
+	};
+	if ((r = sys_page_map_range(pm, 2)) < 0
+	    || (r = sys_env_set_pager(child, fsenv, f->fd_file.id, PAGERREQ)) < 0)
+		return r;
+	return 1;
+}
+
+// Copy the mappings for shared pages into the child address space,
+// except our program file at PAGERFD.
+// Runs of consecutive pages with the same permissions become single
+// requests, and requests are sent to the kernel NSTAGE at a time.
+static int
+copy_shared_pages(envid_t child)
+{
+	struct PageMap pm[NSTAGE];
+	uint32_t pn, perm;
+	int n = 0, r;
+
+	for (pn = USTABDATA / PGSIZE; pn < USTACKTOP / PGSIZE; pn++) {
+		if (!(uvpd[pn >> 10] & PTE_P)) {
+			pn = ROUNDDOWN(pn, 1 << 10) + (1 << 10) - 1;
+			continue;
+		}
+		if (!(uvpt[pn] & PTE_P) || !(uvpt[pn] & PTE_SHARE))
+			continue;
+		// The child gets its own program file, if any
+		if (pn == PGNUM(PAGERFD))
+			continue;
+		perm = uvpt[pn] & PTE_SYSCALL;
+		if (n && pm[n-1].pm_srcva + pm[n-1].pm_npages * PGSIZE == pn * PGSIZE
+		    && pm[n-1].pm_perm == perm) {
+			pm[n-1].pm_npages++;
 			continue;
 		}
-		if ( uvpt[pn] & PTE_SHARE ){
-			r = sys_page_map(0, (void*)(pn*PGSIZE), child, (void*)(pn*PGSIZE), uvpt[pn] & PTE_SYSCALL);
-			if ( r < 0 ) goto fail;
+		if (n == NSTAGE) {
+			if ((r = sys_page_map_range(pm, n)) < 0)
+				goto fail;
+			n = 0;
 		}
-		pn++;
+		pm[n++] = (struct PageMap) { PM_MAP, 0, pn * PGSIZE,
+					     child, pn * PGSIZE, perm, 1 };
 	}
+	if (n && (r = sys_page_map_range(pm, n)) < 0)
+		goto fail;
 	return 0;
 fail:
 	panic("copy_shared_pages: %e", r);
@@ -85,8 +85,26 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_map_range(const struct PageMap *maps, int n)
+{
+	return syscall(SYS_page_map_range, 1, (uint32_t) maps, n, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+int
+sys_env_set_pager(envid_t envid, envid_t pager, int fileid, void *reqva)
+{
+	return syscall(SYS_env_set_pager, 1, envid, pager, fileid, (uint32_t) reqva, 0);
+}
+
+int
+sys_pagein_reply(envid_t envid, int32_t value, void *srcva)
+{
+	return syscall(SYS_pagein_reply, 0, envid, value, (uint32_t) srcva, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -127,6 +145,12 @@ sys_time_msec(void)
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_irq_listen(int irq)
+{
+	return syscall(SYS_irq_listen, 1, irq, 0, 0, 0, 0);
+}
+
 int sys_ether_try_send(void* buf_to_send, size_t sz)
 {
 	return syscall(SYS_ether_try_send, 0, (uint32_t)buf_to_send, sz, 0, 0, 0);
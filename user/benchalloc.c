@@ -0,0 +1,65 @@
+// Measure block allocation cost as the disk fills up.
+//
+// Appends to a file one block at a time until the disk is full, timing
+// each group of CHUNK blocks, then reports the cost per block at several
+// fill levels.  Without a free-space index the last groups are the
+// slowest, since every allocation scans the whole bitmap.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define CHUNK	64
+#define MAXCHUNKS	16384
+
+static char buf[BLKSIZE];
+static uint64_t chunk_cycles[MAXCHUNKS];
+
+// Append one block; returns 0 or a negative error.
+static int
+append_block(int fd)
+{
+	int r;
+	size_t done;
+
+	for (done = 0; done < BLKSIZE; done += r)
+		if ((r = write(fd, buf + done, BLKSIZE - done)) < 0)
+			return r;
+	return 0;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r, i, n, pct;
+	uint32_t nblocks;
+	uint64_t start;
+	static const int report[] = { 10, 50, 80, 90, 95, 99 };
+
+	if ((fd = open("/allocfill", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /allocfill: %e", fd);
+
+	r = 0;
+	nblocks = 0;
+	for (n = 0; n < MAXCHUNKS; n++) {
+		start = read_tsc();
+		for (i = 0; i < CHUNK; i++, nblocks++)
+			if ((r = append_block(fd)) < 0)
+				break;
+		chunk_cycles[n] = read_tsc() - start;
+		if (i < CHUNK)
+			break;
+	}
+	if (r != -E_NO_DISK)
+		cprintf("benchalloc: stopped early: %e\n", r);
+	cprintf("benchalloc: filled the disk with %d blocks\n", nblocks);
+
+	for (i = 0; i < sizeof(report) / sizeof(report[0]); i++) {
+		pct = report[i];
+		r = n * pct / 100;
+		cprintf("benchalloc: %2d%% full: %d cycles/block\n", pct,
+			(uint32_t) (chunk_cycles[r] / CHUNK));
+	}
+
+	ftruncate(fd, 0);
+	close(fd);
+}
@@ -0,0 +1,99 @@
+// Measure sequential and random throughput and truncate time on files
+// from 1MB, which fits behind the indirect block, to 512MB, which lives
+// mostly behind the double-indirect block.
+//
+// The default 4MB disk image is far too small for this; build it with
+// something like "make FSIMGBLOCKS=196608 run-benchbigfile".
+
+#include <inc/lib.h>
+
+#define NRANDOM	2048
+
+static char buf[BLKSIZE];
+
+static int
+writen(int fd, const void *p, size_t n)
+{
+	int r;
+	size_t done;
+
+	for (done = 0; done < n; done += r)
+		if ((r = write(fd, (const char *) p + done, n - done)) <= 0)
+			return r < 0 ? r : -E_NO_DISK;
+	return done;
+}
+
+static unsigned
+mbps(uint32_t nbytes, unsigned msec)
+{
+	return msec ? (nbytes / 1024) * 1000 / 1024 / msec : 0;
+}
+
+static void
+bench(const char *path, uint32_t size)
+{
+	int fd, r;
+	uint32_t off, seed;
+	unsigned start, msec;
+
+	if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+
+	start = sys_time_msec();
+	for (off = 0; off < size; off += BLKSIZE) {
+		*(uint32_t *) buf = off;
+		if ((r = writen(fd, buf, BLKSIZE)) != BLKSIZE) {
+			cprintf("%s: write at %d: %e; enlarge FSIMGBLOCKS\n",
+				path, off, r);
+			goto out;
+		}
+	}
+	msec = sys_time_msec() - start;
+	cprintf("%s: %d MB sequential write: %d ms, %d MB/s\n",
+		path, size >> 20, msec, mbps(size, msec));
+
+	seek(fd, 0);
+	start = sys_time_msec();
+	for (off = 0; off < size; off += BLKSIZE) {
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read %s at %d: %e", path, off, r);
+		if (*(uint32_t *) buf != off)
+			panic("%s: block at %d holds %d", path, off, *(uint32_t *) buf);
+	}
+	msec = sys_time_msec() - start;
+	cprintf("%s: %d MB sequential read: %d ms, %d MB/s\n",
+		path, size >> 20, msec, mbps(size, msec));
+
+	seed = 1;
+	start = sys_time_msec();
+	for (r = 0; r < NRANDOM; r++) {
+		seed = seed * 1103515245 + 12345;
+		off = ROUNDDOWN(seed % size, BLKSIZE);
+		seek(fd, off);
+		if (readn(fd, buf, BLKSIZE) != BLKSIZE || *(uint32_t *) buf != off)
+			panic("random read %s at %d failed", path, off);
+	}
+	msec = sys_time_msec() - start;
+	cprintf("%s: %d random %d-byte reads: %d ms\n",
+		path, NRANDOM, BLKSIZE, msec);
+
+	start = sys_time_msec();
+	if ((r = ftruncate(fd, 0)) < 0)
+		panic("truncate %s: %e", path, r);
+	msec = sys_time_msec() - start;
+	cprintf("%s: %d MB truncate: %d ms\n", path, size >> 20, msec);
+	close(fd);
+	return;
+
+out:
+	ftruncate(fd, 0);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench("/big1", 1 << 20);
+	bench("/big64", 64 << 20);
+	bench("/big512", 512 << 20);
+}
@@ -0,0 +1,46 @@
+// Measure copy-on-write fault cost after fork.  The child writes every
+// page of a heap it shares with its parent, so each fault copies; the
+// parent then writes the pages again once the child is gone, so each
+// fault finds the page unshared and only restores write access.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	1024
+#define HEAP	((char *) 0x20000000)
+
+static uint32_t
+touch(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NPAGES; i++)
+		HEAP[i * PGSIZE]++;
+	return (uint32_t) ((read_tsc() - start) / NPAGES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++)
+		if ((r = sys_page_alloc(0, HEAP + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	cprintf("benchcow: no fault: %u cycles/page\n", touch());
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		cprintf("benchcow: shared page: %u cycles/fault\n", touch());
+		return;
+	}
+	wait(child);
+	cprintf("benchcow: unshared page: %u cycles/fault\n", touch());
+
+	for (i = 0; i < NPAGES; i++)
+		sys_page_unmap(0, HEAP + i * PGSIZE);
+}
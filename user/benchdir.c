@@ -0,0 +1,76 @@
+// Measure create, lookup and remove cost in large directories.
+//
+// A 100k-entry directory needs about 64MB of directory blocks, so build
+// the image with something like "make FSIMGBLOCKS=65536 run-benchdir".
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static uint32_t
+per_op(uint64_t cycles, int n)
+{
+	return n ? (uint32_t) (cycles / n) : 0;
+}
+
+static void
+bench(const char *dir, int n)
+{
+	char path[MAXPATHLEN];
+	int i, fd;
+	uint64_t start, create, lookup, miss, remove_;
+
+	if ((fd = open(dir, O_CREAT|O_EXCL|O_MKDIR)) < 0)
+		panic("mkdir %s: %e", dir, fd);
+	close(fd);
+
+	start = read_tsc();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof path, "%s/f%d", dir, i);
+		if ((fd = open(path, O_CREAT|O_EXCL)) < 0) {
+			cprintf("%s: create %s: %e; enlarge FSIMGBLOCKS\n",
+				dir, path, fd);
+			n = i;
+			break;
+		}
+		close(fd);
+	}
+	create = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof path, "%s/f%d", dir, (i * 7919) % n);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			panic("open %s: %e", path, fd);
+		close(fd);
+	}
+	lookup = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof path, "%s/missing%d", dir, i);
+		if ((fd = open(path, O_RDONLY)) != -E_NOT_FOUND)
+			panic("open %s: %e", path, fd);
+	}
+	miss = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof path, "%s/f%d", dir, i);
+		if ((fd = remove(path)) < 0)
+			panic("remove %s: %e", path, fd);
+	}
+	remove_ = read_tsc() - start;
+	if ((fd = remove(dir)) < 0)
+		panic("remove %s: %e", dir, fd);
+
+	cprintf("%s: %d entries, cycles per op: create %u, lookup %u, "
+		"failed lookup %u, remove %u\n", dir, n, per_op(create, n),
+		per_op(lookup, n), per_op(miss, n), per_op(remove_, n));
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench("/dir10k", 10000);
+	bench("/dir100k", 100000);
+}
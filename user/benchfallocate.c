@@ -0,0 +1,82 @@
+// Measure writing two files at once, a block at a time each, with and
+// without preallocating them, and then reading them back cold.  Without
+// fallocate their blocks interleave on disk.  Also check that a hole
+// reads as zeros, and time truncating a large sparse file.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(1 << 20)
+
+static char buf[BLKSIZE];
+
+static void
+bench(bool prealloc)
+{
+	const char *paths[2] = { "/falloc0", "/falloc1" };
+	int fd[2], i, r;
+	uint32_t off;
+	unsigned start, wmsec, rmsec;
+
+	for (i = 0; i < 2; i++) {
+		if ((fd[i] = open(paths[i], O_RDWR|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", paths[i], fd[i]);
+		if (prealloc && (r = fallocate(fd[i], 0, FILESIZE)) < 0)
+			panic("fallocate %s: %e", paths[i], r);
+	}
+
+	start = sys_time_msec();
+	for (off = 0; off < FILESIZE; off += BLKSIZE)
+		for (i = 0; i < 2; i++)
+			if ((r = write(fd[i], buf, BLKSIZE)) != BLKSIZE)
+				panic("write %s: %e", paths[i], r);
+	wmsec = sys_time_msec() - start;
+
+	fsdropcache();
+	start = sys_time_msec();
+	for (i = 0; i < 2; i++) {
+		seek(fd[i], 0);
+		for (off = 0; off < FILESIZE; off += BLKSIZE)
+			if ((r = readn(fd[i], buf, BLKSIZE)) != BLKSIZE)
+				panic("read %s: %e", paths[i], r);
+	}
+	rmsec = sys_time_msec() - start;
+	cprintf("benchfallocate: %s: write %d ms, cold read %d ms\n",
+		prealloc ? "preallocated" : "allocate on write", wmsec, rmsec);
+
+	for (i = 0; i < 2; i++) {
+		close(fd[i]);
+		remove(paths[i]);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r;
+	unsigned start;
+
+	bench(0);
+	bench(1);
+
+	if ((fd = open("/sparse", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /sparse: %e", fd);
+	if ((r = ftruncate(fd, 256 << 20)) < 0)
+		panic("ftruncate /sparse: %e", r);
+	seek(fd, 100 << 20);
+	if ((r = write(fd, "x", 1)) != 1)
+		panic("write /sparse: %e", r);
+	seek(fd, 50 << 20);
+	memset(buf, 1, sizeof buf);
+	if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+		panic("read /sparse: %e", r);
+	for (i = 0; i < BLKSIZE; i++)
+		if (buf[i])
+			panic("hole in /sparse reads %d at %d", buf[i], i);
+	start = sys_time_msec();
+	if ((r = ftruncate(fd, 0)) < 0)
+		panic("ftruncate /sparse: %e", r);
+	cprintf("benchfallocate: truncated 256MB sparse file in %d ms\n",
+		sys_time_msec() - start);
+	close(fd);
+	remove("/sparse");
+}
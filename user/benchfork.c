@@ -0,0 +1,72 @@
+// Measure fork cost: a forktree-shaped burst of small forks, and forks
+// of an environment with a large heap, where copying the page tables
+// dominates.  "fork" times the call in the parent alone; "fork+wait"
+// also covers the child exiting and being reaped.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define DEPTH		3
+#define NFORK		16
+#define HEAPPAGES	2048
+#define HEAP		((char *) 0x20000000)
+
+static void
+forktree(int depth)
+{
+	envid_t child[2];
+	int i;
+
+	if (depth == DEPTH)
+		return;
+	for (i = 0; i < 2; i++)
+		if ((child[i] = fork()) == 0) {
+			forktree(depth + 1);
+			exit();
+		}
+	for (i = 0; i < 2; i++)
+		wait(child[i]);
+}
+
+static void
+bench(const char *what)
+{
+	uint64_t start, forks, total;
+	envid_t child;
+	int i;
+
+	forks = total = 0;
+	for (i = 0; i < NFORK; i++) {
+		start = read_tsc();
+		if ((child = fork()) == 0)
+			exit();
+		forks += read_tsc() - start;
+		wait(child);
+		total += read_tsc() - start;
+	}
+	cprintf("benchfork: %s: fork %u cycles, fork+wait %u\n", what,
+		(uint32_t) (forks / NFORK), (uint32_t) (total / NFORK));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t start;
+	int i, r;
+
+	start = read_tsc();
+	forktree(0);
+	cprintf("benchfork: forktree depth %d (%d forks): %u cycles\n",
+		DEPTH, (1 << (DEPTH + 1)) - 2, (uint32_t) (read_tsc() - start));
+
+	bench("small");
+
+	for (i = 0; i < HEAPPAGES; i++) {
+		if ((r = sys_page_alloc(0, HEAP + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		HEAP[i * PGSIZE] = i;
+	}
+	bench("8MB heap");
+	for (i = 0; i < HEAPPAGES; i++)
+		sys_page_unmap(0, HEAP + i * PGSIZE);
+}
@@ -0,0 +1,74 @@
+// Measure sys_page_map_range against one system call per page, and the
+// paths that now use it: large malloc/free and spawn.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	256
+#define NITER	16
+#define REGION	((char *) 0x20000000)
+
+static uint32_t
+per(uint64_t cycles, int n)
+{
+	return (uint32_t) (cycles / n);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct PageMap pm[2];
+	uint64_t start, single, range;
+	envid_t child;
+	void *p;
+	int i, j, r;
+
+	single = range = 0;
+	for (j = 0; j < NITER; j++) {
+		start = read_tsc();
+		for (i = 0; i < NPAGES; i++)
+			if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+		for (i = 0; i < NPAGES; i++)
+			if ((r = sys_page_map(0, REGION + i * PGSIZE, 0,
+					      REGION + (NPAGES + i) * PGSIZE, PTE_P|PTE_U)) < 0)
+				panic("sys_page_map: %e", r);
+		for (i = 0; i < 2 * NPAGES; i++)
+			sys_page_unmap(0, REGION + i * PGSIZE);
+		single += read_tsc() - start;
+
+		start = read_tsc();
+		pm[0] = (struct PageMap) { PM_ALLOC, 0, 0, 0, (uintptr_t) REGION,
+					   PTE_P|PTE_U|PTE_W, NPAGES };
+		pm[1] = (struct PageMap) { PM_MAP, 0, (uintptr_t) REGION, 0,
+					   (uintptr_t) REGION + NPAGES * PGSIZE,
+					   PTE_P|PTE_U, NPAGES };
+		if ((r = sys_page_map_range(pm, 2)) < 0)
+			panic("sys_page_map_range: %e", r);
+		pm[0] = (struct PageMap) { PM_UNMAP, 0, 0, 0, (uintptr_t) REGION,
+					   0, 2 * NPAGES };
+		if ((r = sys_page_map_range(pm, 1)) < 0)
+			panic("sys_page_map_range: %e", r);
+		range += read_tsc() - start;
+	}
+	cprintf("benchmap: alloc+map+unmap %d pages: %u cycles/page one at "
+		"a time, %u batched\n", NPAGES, per(single, NITER * NPAGES),
+		per(range, NITER * NPAGES));
+
+	start = read_tsc();
+	for (j = 0; j < NITER; j++) {
+		if (!(p = malloc(NPAGES * PGSIZE - 4)))
+			panic("malloc failed");
+		free(p);
+	}
+	cprintf("benchmap: malloc+free %dKB: %u cycles\n",
+		NPAGES * PGSIZE / 1024, per(read_tsc() - start, NITER));
+
+	start = read_tsc();
+	for (j = 0; j < NITER; j++) {
+		if ((child = spawnl("/echo", "echo", "-n", 0)) < 0)
+			panic("spawn: %e", child);
+		wait(child);
+	}
+	cprintf("benchmap: spawn+wait: %u cycles\n", per(read_tsc() - start, NITER));
+}
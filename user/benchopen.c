@@ -0,0 +1,69 @@
+// Measure open and close cost while hundreds of other files are open.
+//
+// An env can hold only MAXFD descriptors, so forked holders keep the
+// other files open; each tells us when it is ready and waits for word
+// to exit.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NHOLDERS	16
+#define NHELD		25	// files open in each holder
+#define NLOOP		1000
+
+static void
+holder(envid_t parent)
+{
+	int i, fd;
+
+	for (i = 0; i < NHELD; i++)
+		if ((fd = open("/openbench", O_RDONLY)) < 0)
+			panic("holder: open /openbench: %e", fd);
+	ipc_send(parent, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+	exit();
+}
+
+static void
+bench(int nheld)
+{
+	int i, fd;
+	uint64_t start;
+
+	start = read_tsc();
+	for (i = 0; i < NLOOP; i++) {
+		if ((fd = open("/openbench", O_RDONLY)) < 0)
+			panic("open /openbench: %e", fd);
+		close(fd);
+	}
+	cprintf("benchopen: %d files held open: %u cycles per open and close\n",
+		nheld, (uint32_t) ((read_tsc() - start) / NLOOP));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NHOLDERS], parent = thisenv->env_id;
+	int i, r;
+
+	if ((r = open("/openbench", O_CREAT)) < 0)
+		panic("create /openbench: %e", r);
+	close(r);
+
+	bench(0);
+	for (i = 0; i < NHOLDERS; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0)
+			holder(parent);
+		kids[i] = r;
+		ipc_recv(0, 0, 0);
+	}
+	bench(NHOLDERS * NHELD);
+
+	for (i = 0; i < NHOLDERS; i++) {
+		ipc_send(kids[i], 0, 0, 0);
+		wait(kids[i]);
+	}
+	remove("/openbench");
+}
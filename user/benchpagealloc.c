@@ -0,0 +1,88 @@
+// Measure sys_page_alloc latency, fork and spawn with the kernel's
+// pool of pre-zeroed pages full and with it empty.
+//
+// The pool fills only while CPUs have nothing to run, so "idle" reads a
+// file with a cold block cache: everything blocks on the disk and the
+// kernel clears pages in the meantime.  Holding NDRAIN pages empties
+// the pool for the second round.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NALLOC	64
+#define NDRAIN	512
+#define NFORK	16
+#define REGION	((char *) 0x20000000)
+
+static char buf[BLKSIZE];
+
+static void
+idle(void)
+{
+	int fd, i, r;
+
+	for (i = 0; i < 4; i++) {
+		if ((r = fsdropcache()) < 0)
+			panic("fsdropcache: %e", r);
+		if ((fd = open("/init", O_RDONLY)) < 0)
+			panic("open /init: %e", fd);
+		while ((r = read(fd, buf, sizeof buf)) > 0)
+			;
+		close(fd);
+	}
+}
+
+static void
+bench(const char *what, char *region)
+{
+	uint64_t start, alloc, forks, spawns;
+	envid_t child;
+	int i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NALLOC; i++)
+		if ((r = sys_page_alloc(0, region + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	alloc = read_tsc() - start;
+	for (i = 0; i < NALLOC; i++)
+		sys_page_unmap(0, region + i * PGSIZE);
+
+	start = read_tsc();
+	for (i = 0; i < NFORK; i++) {
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0)
+			exit();
+		wait(child);
+	}
+	forks = read_tsc() - start;
+
+	start = read_tsc();
+	for (i = 0; i < NFORK; i++) {
+		if ((child = spawnl("/echo", "echo", "-n", 0)) < 0)
+			panic("spawn: %e", child);
+		wait(child);
+	}
+	spawns = read_tsc() - start;
+
+	cprintf("benchpagealloc: pool %s: sys_page_alloc %u cycles, "
+		"fork+wait %u, spawn+wait %u\n", what,
+		(uint32_t) (alloc / NALLOC), (uint32_t) (forks / NFORK),
+		(uint32_t) (spawns / NFORK));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	idle();
+	bench("full", REGION);
+
+	for (i = 0; i < NDRAIN; i++)
+		if ((r = sys_page_alloc(0, REGION + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	bench("empty", REGION + NDRAIN * PGSIZE);
+	for (i = 0; i < NDRAIN; i++)
+		sys_page_unmap(0, REGION + i * PGSIZE);
+}
@@ -0,0 +1,67 @@
+// Measure repeated opens of nested paths and report how often the file
+// server's path lookup cache answered them.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NOPEN	2000
+
+static const char *dirs[] = {
+	"/pathbench", "/pathbench/a", "/pathbench/a/b", "/pathbench/a/b/c",
+};
+static const char *files[] = {
+	"/pathbench/a/b/c/hot", "/pathbench/a/b/hot", "/pathbench/hot",
+};
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, fd;
+	uint32_t hits, neg, misses;
+	uint64_t start, cycles;
+	struct Fsstat before, after;
+
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		if ((fd = open(dirs[i], O_CREAT|O_MKDIR)) < 0)
+			panic("mkdir %s: %e", dirs[i], fd);
+		close(fd);
+	}
+	for (i = 0; i < ARRAY_SIZE(files); i++) {
+		if ((fd = open(files[i], O_CREAT)) < 0)
+			panic("create %s: %e", files[i], fd);
+		close(fd);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(files) + 1; j++) {
+		if ((fd = fsstat(&before)) < 0)
+			panic("fsstat: %e", fd);
+		start = read_tsc();
+		for (i = 0; i < NOPEN; i++) {
+			if (j == ARRAY_SIZE(files)) {
+				// a path that does not exist
+				if ((fd = open("/pathbench/a/b/c/cold", O_RDONLY)) != -E_NOT_FOUND)
+					panic("open cold: %e", fd);
+				continue;
+			}
+			if ((fd = open(files[j], O_RDONLY)) < 0)
+				panic("open %s: %e", files[j], fd);
+			close(fd);
+		}
+		cycles = read_tsc() - start;
+		fsstat(&after);
+
+		hits = after.st_dcache_hits - before.st_dcache_hits;
+		neg = after.st_dcache_neg_hits - before.st_dcache_neg_hits;
+		misses = after.st_dcache_misses - before.st_dcache_misses;
+		cprintf("%s: %u cycles/open, dcache %u hits, %u negative hits, "
+			"%u misses (%u%% hit)\n",
+			j < ARRAY_SIZE(files) ? files[j] : "/pathbench/a/b/c/cold",
+			(uint32_t) (cycles / NOPEN), hits, neg, misses,
+			(hits + neg) * 100 / MAX(hits + neg + misses, 1));
+	}
+
+	for (i = ARRAY_SIZE(files) - 1; i >= 0; i--)
+		remove(files[i]);
+	for (i = ARRAY_SIZE(dirs) - 1; i >= 0; i--)
+		remove(dirs[i]);
+}
@@ -0,0 +1,68 @@
+// Measure context switch cost: IPC round trips between two
+// environments, and sys_yield between two environments that do nothing
+// else.  Every switch reloads %cr3, so this is where the kernel's
+// global and 4MB mappings pay off: its own TLB entries survive.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	10000
+
+static void
+ipc_bench(void)
+{
+	envid_t who, child;
+	uint64_t start;
+	int i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		while (1) {
+			i = ipc_recv(&who, 0, 0);
+			ipc_send(who, i, 0, 0);
+			if (i == NROUND - 1)
+				exit();
+		}
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(child, i, 0, 0);
+		if (ipc_recv(&who, 0, 0) != i || who != child)
+			panic("ipc_recv: bad reply");
+	}
+	cprintf("benchpingpong: ipc round trip: %u cycles\n",
+		(uint32_t) ((read_tsc() - start) / NROUND));
+	wait(child);
+}
+
+static void
+yield_bench(void)
+{
+	envid_t child;
+	uint64_t start;
+	int i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NROUND; i++)
+			sys_yield();
+		exit();
+	}
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++)
+		sys_yield();
+	cprintf("benchpingpong: sys_yield: %u cycles\n",
+		(uint32_t) ((read_tsc() - start) / NROUND));
+	wait(child);
+}
+
+void
+umain(int argc, char **argv)
+{
+	ipc_bench();
+	yield_bench();
+}
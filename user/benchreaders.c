@@ -0,0 +1,93 @@
+// Measure aggregate read throughput with 1, 4 and 16 parallel readers.
+//
+// Each round starts with a cold block cache and reads the same
+// NFILES files, split evenly among the readers, so the file server can
+// only go faster by overlapping one reader's disk waits with another's
+// work.
+
+#include <inc/lib.h>
+
+#define NFILES		16
+#define FILESIZE	(64 * 1024)
+
+static char buf[FSWINDOW_SIZE];
+
+static void
+path(char *p, int i)
+{
+	snprintf(p, MAXPATHLEN, "/readers%d", i);
+}
+
+static void
+reader(int first, int n)
+{
+	char p[MAXPATHLEN];
+	int i, fd, r;
+
+	for (i = first; i < first + n; i++) {
+		path(p, i);
+		if ((fd = open(p, O_RDONLY)) < 0)
+			panic("open %s: %e", p, fd);
+		while ((r = read(fd, buf, sizeof buf)) > 0)
+			/* discard */;
+		if (r < 0)
+			panic("read %s: %e", p, r);
+		close(fd);
+	}
+}
+
+static void
+bench(int nreaders)
+{
+	envid_t kids[NFILES];
+	unsigned start, msec;
+	int i, r;
+
+	if ((r = fsdropcache()) < 0)
+		panic("fsdropcache: %e", r);
+
+	start = sys_time_msec();
+	for (i = 0; i < nreaders; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			reader(i * NFILES / nreaders, NFILES / nreaders);
+			exit();
+		}
+		kids[i] = r;
+	}
+	for (i = 0; i < nreaders; i++)
+		wait(kids[i]);
+	msec = sys_time_msec() - start;
+
+	cprintf("benchreaders: %2d readers: %d KB in %d ms, %d KB/s\n",
+		nreaders, NFILES * FILESIZE / 1024, msec,
+		msec ? NFILES * FILESIZE / 1024 * 1000 / msec : 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char p[MAXPATHLEN];
+	int i, fd, r;
+
+	memset(buf, 'r', sizeof buf);
+	for (i = 0; i < NFILES; i++) {
+		path(p, i);
+		if ((fd = open(p, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", p, fd);
+		for (r = 0; r < FILESIZE; r += sizeof buf)
+			if (write(fd, buf, sizeof buf) != sizeof buf)
+				panic("write %s; enlarge FSIMGBLOCKS", p);
+		close(fd);
+	}
+
+	bench(1);
+	bench(4);
+	bench(16);
+
+	for (i = 0; i < NFILES; i++) {
+		path(p, i);
+		remove(p);
+	}
+}
@@ -0,0 +1,53 @@
+// Measure reading a file one byte at a time, the way readline reads
+// a script on standard input, with and without the client page cache
+// (only read-only opens use it).
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NLINES	2000
+
+static uint64_t
+read_bytes(const char *path, int omode, int *nbytes)
+{
+	int fd, r;
+	char c;
+	uint64_t start;
+
+	if ((fd = open(path, omode)) < 0)
+		panic("open %s: %e", path, fd);
+	*nbytes = 0;
+	start = read_tsc();
+	while ((r = read(fd, &c, 1)) == 1)
+		++*nbytes;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	start = read_tsc() - start;
+	close(fd);
+	return start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, n;
+	char line[64];
+	uint64_t cached, uncached;
+
+	if ((fd = open("/readlinebench", O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open /readlinebench: %e", fd);
+	for (i = 0; i < NLINES; i++) {
+		snprintf(line, sizeof line, "echo line %d of the script\n", i);
+		if ((n = write(fd, line, strlen(line))) < 0)
+			panic("write /readlinebench: %e", n);
+	}
+	close(fd);
+
+	uncached = read_bytes("/readlinebench", O_RDWR, &n);
+	cached = read_bytes("/readlinebench", O_RDONLY, &n);
+	cprintf("benchreadline: %d bytes, cycles per byte: O_RDWR %u, "
+		"O_RDONLY %u\n", n, (uint32_t) (uncached / n),
+		(uint32_t) (cached / n));
+
+	remove("/readlinebench");
+}
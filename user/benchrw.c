@@ -0,0 +1,72 @@
+// Measure cat- and cp-style throughput with small and large requests.
+//
+// Requests of up to a page go one page per IPC through fsipcbuf; larger
+// ones go through the client's transfer window, up to FSWINDOW_SIZE
+// bytes per IPC.  The 4000-byte runs show the single-page path.
+
+#include <inc/lib.h>
+
+#define FILESIZE	(1 << 20)
+
+static char buf[FSWINDOW_SIZE];
+
+static unsigned
+kbps(uint32_t nbytes, unsigned msec)
+{
+	return msec ? nbytes / 1024 * 1000 / msec : 0;
+}
+
+// Read all of path with n-byte requests, copying it to dst if dst >= 0.
+static void
+copy(const char *path, int dst, size_t n)
+{
+	int fd, r, w;
+	uint32_t total = 0;
+	unsigned start, msec;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	start = sys_time_msec();
+	while ((r = read(fd, buf, n)) > 0) {
+		total += r;
+		if (dst >= 0 && (w = write(dst, buf, r)) != r)
+			panic("write: %e", w);
+	}
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	msec = sys_time_msec() - start;
+	close(fd);
+	if (total != FILESIZE)
+		panic("read %d bytes of %s, want %d", total, path, FILESIZE);
+
+	cprintf("benchrw: %s with %5d-byte requests: %4d ms, %6d KB/s\n",
+		dst >= 0 ? "cp " : "cat", n, msec, kbps(total, msec));
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const size_t sizes[] = { 4000, 16384, FSWINDOW_SIZE };
+	int fd, i, r;
+
+	if ((fd = open("/rwsrc", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /rwsrc: %e", fd);
+	for (i = 0; i < FILESIZE; i += sizeof buf) {
+		memset(buf, i >> 16, sizeof buf);
+		if ((r = write(fd, buf, sizeof buf)) != sizeof buf)
+			panic("write /rwsrc: %e; enlarge FSIMGBLOCKS", r);
+	}
+	close(fd);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++)
+		copy("/rwsrc", -1, sizes[i]);
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if ((fd = open("/rwdst", O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open /rwdst: %e", fd);
+		copy("/rwsrc", fd, sizes[i]);
+		close(fd);
+	}
+
+	remove("/rwsrc");
+	remove("/rwdst");
+}
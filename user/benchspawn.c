@@ -0,0 +1,87 @@
+// Measure spawn cost: the time from calling spawn until the child
+// reaches umain, how many pages the child has resident by then, and
+// spawn+wait for a few bundled programs.  With demand loading, spawn
+// maps nothing but the stack and the pages that mix file data and bss,
+// so a large program starts about as fast as a small one.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NSPAWN		16
+
+// Count the pages present in this environment below UTOP.
+static int
+resident_pages(void)
+{
+	uint32_t pn;
+	int n = 0;
+
+	for (pn = 0; pn < PGNUM(UTOP); pn++) {
+		if (!(uvpd[pn >> 10] & PTE_P)) {
+			pn = ROUNDDOWN(pn, 1 << 10) + (1 << 10) - 1;
+			continue;
+		}
+		if (uvpt[pn] & PTE_P)
+			n++;
+	}
+	return n;
+}
+
+static void
+bench_start(void)
+{
+	uint64_t start, first, total;
+	uint32_t t;
+	envid_t child;
+	int i, resident;
+
+	first = total = resident = 0;
+	for (i = 0; i < NSPAWN; i++) {
+		start = read_tsc();
+		if ((child = spawnl("/benchspawn", "benchspawn", "child", 0)) < 0)
+			panic("spawn: %e", child);
+		t = ipc_recv(NULL, NULL, NULL);
+		first += t - (uint32_t) start;
+		resident += ipc_recv(NULL, NULL, NULL);
+		wait(child);
+		total += read_tsc() - start;
+	}
+	cprintf("benchspawn: spawn to umain %u cycles, %d pages resident, "
+		"spawn+wait %u cycles\n", (uint32_t) (first / NSPAWN),
+		resident / NSPAWN, (uint32_t) (total / NSPAWN));
+}
+
+static void
+bench(const char *prog, const char **argv)
+{
+	uint64_t start;
+	envid_t child;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NSPAWN; i++) {
+		if ((child = spawn(prog, argv)) < 0)
+			panic("spawn %s: %e", prog, child);
+		wait(child);
+	}
+	cprintf("benchspawn: %s: spawn+wait %u cycles\n", prog,
+		(uint32_t) ((read_tsc() - start) / NSPAWN));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t t = read_tsc();
+	const char *echo[] = { "echo", "-n", "", 0 };
+	const char *ls[] = { "ls", "-d", "/", 0 };
+
+	if (argc > 1) {
+		ipc_send(thisenv->env_parent_id, t, NULL, 0);
+		ipc_send(thisenv->env_parent_id, resident_pages(), NULL, 0);
+		return;
+	}
+
+	bench_start();
+	bench("/echo", echo);
+	bench("/ls", ls);
+}
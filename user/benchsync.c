@@ -0,0 +1,49 @@
+// Measure the cost of sync on a disk with few dirty blocks, and of
+// syncing a file written at scattered offsets.  Sync should cost in
+// proportion to the dirty blocks, not the disk, so build the image
+// large to see it: "make FSIMGBLOCKS=196608 run-benchsync".
+
+#include <inc/lib.h>
+
+#define NSYNC	100
+#define NSCATTER	128
+
+static char buf[BLKSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r;
+	uint32_t seed;
+	unsigned start, msec;
+
+	sync();
+	start = sys_time_msec();
+	for (i = 0; i < NSYNC; i++)
+		sync();
+	msec = sys_time_msec() - start;
+	cprintf("benchsync: %d syncs of a clean disk: %d ms\n", NSYNC, msec);
+
+	if ((fd = open("/syncfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /syncfile: %e", fd);
+	if ((r = fallocate(fd, 0, NSCATTER * 2 * BLKSIZE)) < 0)
+		panic("fallocate /syncfile: %e", r);
+	sync();
+
+	seed = 1;
+	for (i = 0; i < NSCATTER; i++) {
+		seed = seed * 1103515245 + 12345;
+		seek(fd, (seed >> 8) % (NSCATTER * 2) * BLKSIZE);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write /syncfile: %e", r);
+	}
+	start = sys_time_msec();
+	sync();
+	msec = sys_time_msec() - start;
+	cprintf("benchsync: sync of %d scattered blocks: %d ms\n",
+		NSCATTER, msec);
+
+	ftruncate(fd, 0);
+	close(fd);
+	remove("/syncfile");
+}
@@ -0,0 +1,116 @@
+// Print the file server's statistics, or with -t, save its event trace
+// to a file as raw struct Fstrace records.
+
+#include <inc/lib.h>
+
+static const char *reqnames[NFSREQ] = {
+	[0] =			"invalid",
+	[FSREQ_OPEN] =		"open",
+	[FSREQ_SET_SIZE] =	"set_size",
+	[FSREQ_READ] =		"read",
+	[FSREQ_WRITE] =		"write",
+	[FSREQ_STAT] =		"stat",
+	[FSREQ_FLUSH] =		"flush",
+	[FSREQ_REMOVE] =	"remove",
+	[FSREQ_SYNC] =		"sync",
+	[FSREQ_FSSTAT] =	"fsstat",
+	[FSREQ_MAP] =		"map",
+	[FSREQ_WINDOW] =	"window",
+	[FSREQ_READ_WINDOW] =	"read_window",
+	[FSREQ_WRITE_WINDOW] =	"write_window",
+	[FSREQ_DROP_CACHE] =	"drop_cache",
+	[FSREQ_CLOSE] =		"close",
+	[FSREQ_FALLOCATE] =	"fallocate",
+	[FSREQ_TRACE] =		"trace",
+	[FSREQ_SNAPSHOT] =	"snapshot",
+	[FSREQ_PAGEIN] =	"pagein",
+};
+
+static struct Fstrace ents[256];
+
+static void
+usage(void)
+{
+	printf("usage: fsstat [-t tracefile]\n");
+	exit();
+}
+
+static void
+savetrace(const char *path)
+{
+	int fd, n, r, total = 0;
+	uint32_t pos = 0, want, lost = 0;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	while (1) {
+		want = pos;
+		if ((n = fstrace(&pos, ents, ARRAY_SIZE(ents))) < 0)
+			panic("fstrace: %e", n);
+		if (n == 0)
+			break;
+		lost += pos - want;
+		if ((r = write(fd, ents, n * sizeof ents[0])) != n * sizeof ents[0])
+			panic("write %s: %e", path, r);
+		pos += n;
+		total += n;
+	}
+	close(fd);
+	printf("%d events saved to %s, %d lost\n", total, path, lost);
+}
+
+static void
+printstats(void)
+{
+	struct Fsstat st;
+	int i, b, r;
+
+	if ((r = fsstat(&st)) < 0)
+		panic("fsstat: %e", r);
+
+	printf("path cache: %u hits, %u negative hits, %u misses\n",
+	       st.st_dcache_hits, st.st_dcache_neg_hits, st.st_dcache_misses);
+	printf("block cache: %u hits, %u misses, %u blocks flushed\n",
+	       st.st_bc_hits, st.st_bc_misses, st.st_bc_flushes);
+	printf("disk: %u sectors read, %u written, %u Mcycles waiting\n",
+	       st.st_ide_sectors_read, st.st_ide_sectors_written,
+	       (uint32_t) (st.st_ide_wait_cycles >> 20));
+
+	printf("%-12s %8s %10s  latency histogram (bucket 0 < 2^%d cycles)\n",
+	       "request", "count", "avg cycles", FSSTAT_SHIFT);
+	for (i = 0; i < NFSREQ; i++) {
+		if (!st.st_req_count[i])
+			continue;
+		printf("%-12s %8u %10u ", reqnames[i], st.st_req_count[i],
+		       (uint32_t) (st.st_req_cycles[i] / st.st_req_count[i]));
+		for (b = 0; b < FSSTAT_NBUCKETS; b++)
+			printf(" %u", st.st_req_hist[i][b]);
+		printf("\n");
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+	const char *tracefile = 0;
+	struct Argstate args;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 't':
+			if (!(tracefile = argvalue(&args)))
+				usage();
+			break;
+		default:
+			usage();
+		}
+	if (argc != 1)
+		usage();
+
+	if (tracefile)
+		savetrace(tracefile);
+	else
+		printstats();
+}
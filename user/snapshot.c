@@ -0,0 +1,33 @@
+// Create a snapshot of the file system, or with -d, delete one.
+// A snapshot called NAME is read-only and appears under /.snap/NAME.
+
+#include <inc/lib.h>
+
+static void
+usage(void)
+{
+	printf("usage: snapshot [-d] name\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r, del = 0;
+	struct Argstate args;
+
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'd':
+			del = 1;
+			break;
+		default:
+			usage();
+		}
+	if (argc != 2)
+		usage();
+
+	if ((r = del ? snapshot_delete(argv[1]) : snapshot(argv[1])) < 0)
+		printf("snapshot %s: %e\n", argv[1], r);
+}
@@ -18,6 +18,129 @@ xopen(const char *path, int mode)
 	return ipc_recv(NULL, FVA, NULL);
 }
 
+// Check that path holds exactly the n bytes at want.
+static void
+expect(const char *path, const char *want, int n)
+{
+	char buf[512];
+	int f, r;
+
+	if ((f = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, f);
+	if ((r = readn(f, buf, sizeof buf)) != n)
+		panic("read %s returned %d bytes, want %d", path, r, n);
+	if (memcmp(buf, want, n) != 0)
+		panic("read %s returned bad data", path);
+	close(f);
+}
+
+// Small files keep their data in the struct File (FILEINLINE bytes).
+// Check the moves between there and a block as a file grows and
+// shrinks, and that an inline file can be mapped.
+static void
+inline_test(void)
+{
+	char data[256], *va = (char *) 0x10000000;
+	int f, r, i;
+
+	for (i = 0; i < sizeof data; i++)
+		data[i] = 'a' + i % 26;
+
+	// Grow past FILEINLINE
+	if ((f = open("/inline", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("creat /inline: %e", f);
+	if ((r = write(f, data, FILEINLINE / 2)) != FILEINLINE / 2)
+		panic("write /inline: %e", r);
+	expect("/inline", data, FILEINLINE / 2);
+	if ((r = write(f, data + FILEINLINE / 2, sizeof data - FILEINLINE / 2))
+	    != sizeof data - FILEINLINE / 2)
+		panic("write /inline past FILEINLINE: %e", r);
+	expect("/inline", data, sizeof data);
+
+	// Shrink back and grow again, keeping the block and then back
+	// inline: the new bytes read as zeros either way
+	if ((r = ftruncate(f, 10)) < 0)
+		panic("truncate /inline: %e", r);
+	expect("/inline", data, 10);
+	if ((r = ftruncate(f, 2 * FILEINLINE)) < 0)
+		panic("grow /inline: %e", r);
+	memset(data + 10, 0, 2 * FILEINLINE - 10);
+	expect("/inline", data, 2 * FILEINLINE);
+	for (i = 0; i < sizeof data; i++)
+		data[i] = 'a' + i % 26;
+
+	if ((r = ftruncate(f, 0)) < 0)
+		panic("truncate /inline: %e", r);
+	seek(f, 0);
+	if ((r = write(f, data, FILEINLINE / 2)) != FILEINLINE / 2)
+		panic("rewrite /inline: %e", r);
+	if ((r = ftruncate(f, 10)) < 0 || (r = ftruncate(f, FILEINLINE)) < 0)
+		panic("truncate /inline: %e", r);
+	memset(data + 10, 0, FILEINLINE - 10);
+	expect("/inline", data, FILEINLINE);
+	if ((r = ftruncate(f, 2 * FILEINLINE)) < 0)
+		panic("grow /inline past FILEINLINE: %e", r);
+	memset(data + FILEINLINE, 0, FILEINLINE);
+	expect("/inline", data, 2 * FILEINLINE);
+	close(f);
+	cprintf("inline file is good\n");
+
+	// Map an inline file
+	for (i = 0; i < FILEINLINE; i++)
+		data[i] = 'A' + i % 26;
+	if ((f = open("/inline", O_RDWR|O_TRUNC)) < 0)
+		panic("open /inline: %e", f);
+	if ((r = write(f, data, FILEINLINE)) != FILEINLINE)
+		panic("write /inline: %e", r);
+	if ((r = mmap(va, PGSIZE, PROT_READ, f, 0)) < 0)
+		panic("mmap /inline: %e", r);
+	if (memcmp(va, data, FILEINLINE) != 0)
+		panic("mmap of an inline file returned bad data");
+	munmap(va, PGSIZE);
+	close(f);
+	remove("/inline");
+	cprintf("mmap of inline file is good\n");
+}
+
+// The client's window (see lib/file.c)
+#define FSWINDOW	((char *) 0xD0000000 - FSWINDOW_SIZE)
+
+// Check that the server lets go of a client's window once the client
+// exits.  A child reads through its window and sends back the physical
+// page of its first window page, which then only the server maps.
+static void
+window_test(void)
+{
+	static char buf[2 * PGSIZE];
+	envid_t child;
+	size_t pn;
+	int f, r, i;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if ((f = open("/big", O_RDONLY)) < 0)
+			panic("open /big: %e", f);
+		if ((r = readn(f, buf, sizeof buf)) != sizeof buf)
+			panic("read /big through the window: %e", r);
+		close(f);
+		ipc_send(thisenv->env_parent_id, PGNUM(uvpt[PGNUM(FSWINDOW)]),
+			 0, 0);
+		exit();
+	}
+	pn = ipc_recv(NULL, 0, NULL);
+	wait(child);
+
+	// The server unmaps the window between requests.  It unmaps the
+	// first page first, so the few pages allocated since come from the
+	// later ones.
+	for (i = 0; i < 10 && pages[pn].pp_ref != 0; i++)
+		sync();
+	if (pages[pn].pp_ref != 0)
+		panic("window page still mapped after its client exited");
+	cprintf("window pages freed\n");
+}
+
 void
 umain(int argc, char **argv)
 {
@@ -124,5 +247,8 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	inline_test();
+	window_test();
 }
 
@@ -0,0 +1,77 @@
+// Test user pages above the kernel's direct map of physical memory.
+//
+// Allocates pages until it has NPAGES or memory runs out, reports how
+// many landed above the first 256MB, and checks that data written to
+// them survives, including through fork's copy-on-write copies, which
+// the kernel makes through kmap.  Run with more memory than the direct
+// map covers, e.g. "make QEMUEXTRA='-m 2048' run-testhighmem".
+
+#include <inc/lib.h>
+
+#define NPAGES		(128 * 1024)
+#define BASE		((char *) 0x10000000)
+#define DIRECTMAP	0x10000000	// physical memory mapped at KERNBASE
+
+static uint32_t
+pattern(uint32_t i, uint32_t gen)
+{
+	return i * 2654435761U + gen;
+}
+
+static void
+check(uint32_t n, uint32_t gen)
+{
+	uint32_t i;
+
+	for (i = 0; i < n; i++)
+		if (*(uint32_t *) (BASE + i * PGSIZE) != pattern(i, gen)
+		    || *(uint32_t *) (BASE + (i + 1) * PGSIZE - 4) != pattern(i, gen))
+			panic("page %d (pa %08x) lost its data", i,
+			      PTE_ADDR(uvpt[PGNUM(BASE + i * PGSIZE)]));
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t i, n, high = 0;
+	envid_t child;
+	int r;
+
+	for (n = 0; n < NPAGES; n++) {
+		if ((r = sys_page_alloc(0, BASE + n * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			break;
+		if (PTE_ADDR(uvpt[PGNUM(BASE + n * PGSIZE)]) >= DIRECTMAP)
+			high++;
+		*(uint32_t *) (BASE + n * PGSIZE) = pattern(n, 0);
+		*(uint32_t *) (BASE + (n + 1) * PGSIZE - 4) = pattern(n, 0);
+	}
+	// Leave memory for fork's page tables and copies
+	if (n < NPAGES)
+		for (i = 0; n > 0 && i < NPAGES / 32; i++, n--) {
+			if (PTE_ADDR(uvpt[PGNUM(BASE + (n - 1) * PGSIZE)]) >= DIRECTMAP)
+				high--;
+			sys_page_unmap(0, BASE + (n - 1) * PGSIZE);
+		}
+	cprintf("testhighmem: %d pages, %d above the direct map\n", n, high);
+	check(n, 0);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < n; i += 64) {
+			*(uint32_t *) (BASE + i * PGSIZE) = pattern(i, 1);
+			*(uint32_t *) (BASE + (i + 1) * PGSIZE - 4) = pattern(i, 1);
+		}
+		for (i = 0; i < n; i++)
+			if (*(uint32_t *) (BASE + (i + 1) * PGSIZE - 4)
+			    != pattern(i, i % 64 == 0))
+				panic("child: copy of page %d is wrong", i);
+		exit();
+	}
+	wait(child);
+	check(n, 0);
+
+	for (i = 0; i < n; i++)
+		sys_page_unmap(0, BASE + i * PGSIZE);
+	cprintf("testhighmem OK\n");
+}
@@ -0,0 +1,48 @@
+// Test mmap: read-only maps share the file server's pages, writable
+// maps are private copies that never reach the file.
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x30000000)
+
+void
+umain(int argc, char **argv)
+{
+	char buf[512];
+	struct Stat st;
+	int fd, r, n;
+
+	if ((fd = open("/newmotd", O_RDONLY)) < 0)
+		panic("open /newmotd: %e", fd);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+	n = MIN(st.st_size, sizeof buf);
+	if ((r = readn(fd, buf, n)) != n)
+		panic("readn: %e", r);
+
+	if ((r = mmap(VA, st.st_size, PROT_READ, fd, 0)) < 0)
+		panic("mmap: %e", r);
+	if (memcmp(VA, buf, n) != 0)
+		panic("mapped data differs from read data");
+	if (mmap(VA + PGSIZE / 2, PGSIZE, PROT_READ, fd, 0) != -E_INVAL)
+		panic("overlapping mmap succeeded");
+	if ((r = munmap(VA, st.st_size)) < 0)
+		panic("munmap: %e", r);
+	cprintf("mmap read-only is good\n");
+
+	if ((r = mmap(VA, st.st_size, PROT_READ|PROT_WRITE, fd, 0)) < 0)
+		panic("mmap: %e", r);
+	VA[0] = ~buf[0];
+	if (VA[0] != (char) ~buf[0] || memcmp(VA + 1, buf + 1, n - 1) != 0)
+		panic("private mapping has the wrong data");
+	if ((r = munmap(VA, st.st_size)) < 0)
+		panic("munmap: %e", r);
+	if ((r = mmap(VA, st.st_size, PROT_READ, fd, 0)) < 0)
+		panic("mmap: %e", r);
+	if (VA[0] != buf[0])
+		panic("private write reached the file");
+	munmap(VA, st.st_size);
+	cprintf("mmap private write is good\n");
+
+	close(fd);
+}
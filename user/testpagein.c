@@ -0,0 +1,50 @@
+// Check that page-ins do not get mixed up with ordinary file server
+// replies.  A spawned copy of this program sends a request to the file
+// server and, before receiving the reply, touches a page of its data
+// that is not loaded yet, so that the page-in races the outstanding
+// request.  Each must get its own answer.
+
+#include <inc/lib.h>
+
+#define NPAGES		8
+#define P(i)		[(i) * PGSIZE / 4] = 0x1000 + (i)
+
+// Initialized, so it comes from the program file on demand
+static uint32_t data[NPAGES * PGSIZE / 4] = {
+	P(0), P(1), P(2), P(3), P(4), P(5), P(6), P(7)
+};
+
+static union Fsipc req __attribute__((aligned(PGSIZE)));
+
+static void
+child(void)
+{
+	envid_t fsenv = ipc_find_env(ENV_TYPE_FS), from;
+	uint32_t v;
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		ipc_send(fsenv, FSREQ_SYNC, &req, PTE_P|PTE_W|PTE_U);
+		v = data[i * PGSIZE / 4];
+		r = ipc_recv(&from, 0, 0);
+		if (from != fsenv || r != 0)
+			panic("reply %d: %e from %08x", i, r, from);
+		if (v != 0x1000 + i)
+			panic("page %d holds %08x", i, v);
+	}
+	cprintf("testpagein OK\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t env;
+
+	if (argc > 1) {
+		child();
+		return;
+	}
+	if ((env = spawnl("/testpagein", "testpagein", "child", 0)) < 0)
+		panic("spawn: %e", env);
+	wait(env);
+}
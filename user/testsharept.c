@@ -0,0 +1,68 @@
+// Check that fork shares a page table holding only read-only mappings,
+// and that changing a mapping in the child gives it a private copy
+// without disturbing the parent.
+
+#include <inc/lib.h>
+
+#define NPAGES	16
+#define REGION	((char *) 0x40000000)	// PTSIZE-aligned
+
+static void
+check_region(const char *who)
+{
+	int i;
+
+	for (i = 0; i < NPAGES; i++) {
+		if (!(uvpt[PGNUM(REGION + i * PGSIZE)] & PTE_P))
+			panic("%s: page %d unmapped", who, i);
+		if (REGION[i * PGSIZE] != (char) i)
+			panic("%s: page %d holds %d", who, i, REGION[i * PGSIZE]);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct PageMap pm[2];
+	physaddr_t pt;
+	envid_t child;
+	int i, r;
+
+	pm[0] = (struct PageMap) { PM_ALLOC, 0, 0, 0, (uintptr_t) REGION,
+				   PTE_P|PTE_U|PTE_W, NPAGES };
+	if ((r = sys_page_map_range(pm, 1)) < 0)
+		panic("sys_page_map_range: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		REGION[i * PGSIZE] = i;
+	pm[0] = (struct PageMap) { PM_MAP, 0, (uintptr_t) REGION, 0,
+				   (uintptr_t) REGION, PTE_P|PTE_U, NPAGES };
+	if ((r = sys_page_map_range(pm, 1)) < 0)
+		panic("sys_page_map_range: %e", r);
+	pt = PTE_ADDR(uvpd[PDX(REGION)]);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		if (PTE_ADDR(uvpd[PDX(REGION)]) != pt)
+			panic("child: page table not shared");
+		check_region("child");
+
+		// Mapping a new page must give us our own page table.
+		if ((r = sys_page_alloc(0, REGION + NPAGES * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		if (PTE_ADDR(uvpd[PDX(REGION)]) == pt)
+			panic("child: page table still shared after a change");
+		check_region("child");
+		sys_page_unmap(0, REGION);
+		exit();
+	}
+	wait(child);
+
+	check_region("parent");
+	if (uvpt[PGNUM(REGION + NPAGES * PGSIZE)] & PTE_P)
+		panic("parent: sees the child's new page");
+	if (pages[PGNUM(pt)].pp_ref != 1)
+		panic("parent: page table pp_ref %d after the child exited",
+		      pages[PGNUM(pt)].pp_ref);
+	cprintf("testsharept: OK\n");
+}
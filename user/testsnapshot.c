@@ -0,0 +1,152 @@
+// Check that a snapshot keeps the file system as it was while the live
+// tree changes, and that it cannot be written.
+//
+// The last check uses a file that reaches the double-indirect block,
+// which does not fit on the default disk image; it is skipped unless
+// the image is larger, e.g. "make FSIMGBLOCKS=4096 run-testsnapshot".
+
+#include <inc/lib.h>
+
+// Just past what the direct and indirect blocks cover
+#define BIGBLOCKS	(NDIRECT + NINDIRECT + 16)
+
+static char buf[BLKSIZE];
+
+static void
+writefile(const char *path, const char *s)
+{
+	int fd, r;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	if ((r = write(fd, s, strlen(s))) != strlen(s))
+		panic("write %s: %e", path, r);
+	close(fd);
+}
+
+static void
+expect(const char *path, const char *s)
+{
+	char buf[64];
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	if ((r = readn(fd, buf, sizeof buf - 1)) < 0)
+		panic("read %s: %e", path, r);
+	buf[r] = 0;
+	if (strcmp(buf, s) != 0)
+		panic("%s holds \"%s\", want \"%s\"", path, buf, s);
+	close(fd);
+}
+
+// Write gen into every block of path, which has BIGBLOCKS blocks.
+// Returns 0, or -E_NO_DISK if the disk is too small.
+static int
+writebig(const char *path, uint32_t gen)
+{
+	int fd, r;
+	uint32_t i;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT)) < 0)
+		panic("open %s: %e", path, fd);
+	for (i = 0; i < BIGBLOCKS; i++) {
+		((uint32_t *) buf)[0] = i;
+		((uint32_t *) buf)[1] = gen;
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE) {
+			close(fd);
+			if (r >= 0 || r == -E_NO_DISK)
+				return -E_NO_DISK;
+			panic("write %s block %d: %e", path, i, r);
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+static void
+expectbig(const char *path, uint32_t gen)
+{
+	int fd, r;
+	uint32_t i;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	for (i = 0; i < BIGBLOCKS; i++) {
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read %s block %d: %e", path, i, r);
+		if (((uint32_t *) buf)[0] != i || ((uint32_t *) buf)[1] != gen)
+			panic("%s block %d holds %d/%d, want %d/%d", path, i,
+			      ((uint32_t *) buf)[0], ((uint32_t *) buf)[1],
+			      i, gen);
+	}
+	close(fd);
+}
+
+// A snapshot of a file with a double-indirect block gets its own copies
+// of the indirect blocks, so deleting the snapshot after the live file
+// changes leaves the live file intact.
+static void
+check_big(void)
+{
+	int r;
+
+	if (writebig("/snapbig", 0) < 0) {
+		cprintf("skipping the large file check; enlarge FSIMGBLOCKS\n");
+		remove("/snapbig");
+		return;
+	}
+	if ((r = snapshot("big")) < 0)
+		panic("snapshot: %e", r);
+	if (writebig("/snapbig", 1) < 0)
+		panic("no room to rewrite /snapbig; enlarge FSIMGBLOCKS");
+	expectbig("/.snap/big/snapbig", 0);
+	expectbig("/snapbig", 1);
+	if ((r = snapshot_delete("big")) < 0)
+		panic("snapshot_delete: %e", r);
+
+	// Reuse the blocks the snapshot freed
+	if (writebig("/snapfill", 2) < 0)
+		panic("no room for /snapfill; enlarge FSIMGBLOCKS");
+	expectbig("/snapbig", 1);
+	expectbig("/snapfill", 2);
+	remove("/snapbig");
+	remove("/snapfill");
+	cprintf("snapshot of a large file is good\n");
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r;
+
+	writefile("/snapfile", "before");
+	if ((r = snapshot("t")) < 0)
+		panic("snapshot: %e", r);
+	writefile("/snapfile", "after!");
+	expect("/snapfile", "after!");
+	expect("/.snap/t/snapfile", "before");
+	cprintf("snapshot keeps old data\n");
+
+	if ((r = remove("/snapfile")) < 0)
+		panic("remove: %e", r);
+	expect("/.snap/t/snapfile", "before");
+	if ((fd = open("/.snap/t/snapfile", O_RDWR)) != -E_INVAL)
+		panic("open for writing in a snapshot: %e", fd);
+	if ((r = remove("/.snap/t/snapfile")) != -E_INVAL)
+		panic("remove in a snapshot: %e", r);
+	cprintf("snapshot is read-only\n");
+
+	if ((fd = open("/.snap/t/snapfile", O_RDONLY)) < 0)
+		panic("open: %e", fd);
+	if ((r = snapshot_delete("t")) != -E_BUSY)
+		panic("deleting a snapshot in use: %e", r);
+	close(fd);
+	if ((r = snapshot_delete("t")) < 0)
+		panic("snapshot_delete: %e", r);
+	if ((fd = open("/.snap/t/snapfile", O_RDONLY)) != -E_NOT_FOUND)
+		panic("deleted snapshot still there: %e", fd);
+	cprintf("snapshot delete is good\n");
+
+	check_big();
+}